@@ -0,0 +1,489 @@
+/** \file   assemble.c
+ * \brief   Parallel output assembly
+ *
+ * Writes the live lines of a file in parallel: while evaluating, the live
+ * lines are recorded as spans of the input file, contiguous lines coalesced
+ * into a single span. Afterwards the spans are split into chunks, the output
+ * size of each chunk is prefix-summed into its offset in the output file, the
+ * output file is preallocated and each chunk is written to its offset by its
+ * own thread.
+ *
+ * The input file is mapped into memory and the spans are written straight
+ * from the mapping with \c pwritev(2), so the live text is never copied in
+ * user space and memory use scales with the number of spans, not with the
+ * size of the output. When the input can't be mapped the spans are copied
+ * with \c pread(2) and \c pwrite(2) through a buffer instead.
+ *
+ * The output is identical to writing the live lines one after the other. When
+ * stdout isn't a regular file, or is opened for appending, the chunks are
+ * written in order with \c writev(2) or \c write(2) instead.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "assemble.h"
+
+
+/** \brief  Size of the copy buffer of each job */
+#define ASSEMBLE_BUFFER_SIZE    (1024 * 1024)
+
+/** \brief  Maximum number of I/O vectors per write */
+#ifdef IOV_MAX
+# define ASSEMBLE_IOV_MAX       IOV_MAX
+#else
+# define ASSEMBLE_IOV_MAX       1024
+#endif
+
+
+/** \brief  Span of live lines in the input file
+ *
+ * Each span is written followed by a newline, newlines between coalesced
+ * lines are part of the span.
+ */
+typedef struct span_s {
+    uint64_t offset;    /**< offset in input file */
+    uint64_t len;       /**< length, excluding the final newline */
+} span_t;
+
+/** \brief  Copy job for a chunk of spans
+ */
+typedef struct job_s {
+    size_t     first;   /**< index of first span */
+    size_t     last;    /**< index of span after the last span */
+    uint64_t   offset;  /**< offset of the chunk in the output file */
+    char      *buffer;  /**< copy buffer */
+    pthread_t  thread;  /**< thread copying the chunk */
+    bool       running; /**< \c thread was started */
+    bool       ok;      /**< chunk was copied successfully */
+} job_t;
+
+
+/** \brief  Spans of live lines */
+static span_t *spans;
+
+/** \brief  Number of spans allocated in \c spans */
+static size_t spans_size;
+
+/** \brief  Number of spans in \c spans */
+static size_t spans_count;
+
+/** \brief  Copy jobs */
+static job_t *jobs;
+
+/** \brief  Number of jobs allocated in \c jobs */
+static unsigned int jobs_size;
+
+/** \brief  File descriptor of input file */
+static int input_fd;
+
+/** \brief  File descriptor of output file */
+static int output_fd;
+
+/** \brief  Write chunks at their offset with \c pwrite(2) */
+static bool positional;
+
+/** \brief  Input file mapped into memory, \c NULL to copy with \c pread(2) */
+static const char *input_map;
+
+/** \brief  Size of \c input_map */
+static uint64_t input_size;
+
+
+/** \brief  Write data to output
+ *
+ * \param[in]   data    data
+ * \param[in]   len     length of \a data
+ * \param[in]   offset  offset in output file, when using \c pwrite(2)
+ *
+ * \return  \c false on error
+ */
+static bool write_all(const char *data, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        ssize_t n;
+
+        if (positional) {
+            n = pwrite(output_fd, data, len, (off_t)offset);
+        } else {
+            n = write(output_fd, data, len);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data   += n;
+        len    -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return true;
+}
+
+/** \brief  Write I/O vectors to output
+ *
+ * \param[in,out]   iov     I/O vectors, modified on partial writes
+ * \param[in]       count   number of vectors in \a iov
+ * \param[in]       offset  offset in output file, when using \c pwritev(2)
+ *
+ * \return  \c false on error
+ */
+static bool writev_all(struct iovec *iov, int count, uint64_t offset)
+{
+    while (count > 0) {
+        ssize_t n;
+
+        if (positional) {
+            n = pwritev(output_fd, iov, count, (off_t)offset);
+        } else {
+            n = writev(output_fd, iov, count);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        offset += (uint64_t)n;
+
+        /* skip the vectors written, adjust a partially written one */
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base  = (char *)iov->iov_base + n;
+            iov->iov_len  -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+/** \brief  Write chunk of spans from the mapped input to output
+ *
+ * Spans are written without copying them: a span and the newline following
+ * it in the input form a single I/O vector, the newline is only added
+ * separately for the last line without line ending and for CRLF lines.
+ *
+ * \param[in,out]   job job
+ *
+ * \return  \c false on error
+ */
+static bool job_writev(job_t *job)
+{
+    static const char  newline = '\n';
+    struct iovec       iov[ASSEMBLE_IOV_MAX];
+    uint64_t           offset = job->offset;
+    uint64_t           size   = 0;
+    int                count  = 0;
+
+    for (size_t i = job->first; i < job->last; i++) {
+        const char *data = input_map + spans[i].offset;
+        size_t      len  = (size_t)spans[i].len;
+
+        if (count + 2 > ASSEMBLE_IOV_MAX) {
+            if (!writev_all(iov, count, offset)) {
+                return false;
+            }
+            offset += size;
+            size    = 0;
+            count   = 0;
+        }
+        if (spans[i].offset + len < input_size && data[len] == '\n') {
+            iov[count].iov_base = (void *)(uintptr_t)data;
+            iov[count].iov_len  = len + 1;
+            count++;
+        } else {
+            if (len > 0) {
+                iov[count].iov_base = (void *)(uintptr_t)data;
+                iov[count].iov_len  = len;
+                count++;
+            }
+            iov[count].iov_base = (void *)(uintptr_t)&newline;
+            iov[count].iov_len  = 1;
+            count++;
+        }
+        size += len + 1;
+    }
+    return writev_all(iov, count, offset);
+}
+
+/** \brief  Copy chunk of spans from input to output
+ *
+ * \param[in,out]   arg job (\c job_t *)
+ *
+ * \return  \c NULL
+ */
+static void *job_run(void *arg)
+{
+    job_t    *job    = arg;
+    uint64_t  offset = job->offset;
+    size_t    used   = 0;
+
+    job->ok = false;
+    if (input_map != NULL) {
+        job->ok = job_writev(job);
+        return NULL;
+    }
+    for (size_t i = job->first; i < job->last; i++) {
+        uint64_t pos  = spans[i].offset;
+        uint64_t left = spans[i].len + 1;
+
+        while (left > 0) {
+            size_t  n = ASSEMBLE_BUFFER_SIZE - used;
+            ssize_t r;
+
+            if (n > left) {
+                n = (size_t)left;
+            }
+            if (left == 1) {
+                /* final newline, which isn't in the input for the last line,
+                 * or for lines ending with CRLF */
+                job->buffer[used] = '\n';
+                r = 1;
+            } else {
+                if (n == left) {
+                    n--;
+                }
+                r = pread(input_fd, job->buffer + used, n, (off_t)pos);
+                if (r < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (r <= 0) {
+                    return NULL;
+                }
+            }
+            used += (size_t)r;
+            pos  += (uint64_t)r;
+            left -= (uint64_t)r;
+
+            if (used == ASSEMBLE_BUFFER_SIZE) {
+                if (!write_all(job->buffer, used, offset)) {
+                    return NULL;
+                }
+                offset += used;
+                used    = 0;
+            }
+        }
+    }
+    if (!write_all(job->buffer, used, offset)) {
+        return NULL;
+    }
+    job->ok = true;
+    return NULL;
+}
+
+
+/** \brief  Reset spans for the next file
+ *
+ * Memory allocated is kept.
+ */
+void assemble_reset(void)
+{
+    spans_count = 0;
+}
+
+
+/** \brief  Free memory used for assembling output
+ */
+void assemble_free(void)
+{
+    for (unsigned int i = 0; i < jobs_size; i++) {
+        free(jobs[i].buffer);
+    }
+    free(jobs);
+    free(spans);
+    jobs        = NULL;
+    jobs_size   = 0;
+    spans       = NULL;
+    spans_size  = 0;
+    spans_count = 0;
+}
+
+
+/** \brief  Add live line
+ *
+ * The line is coalesced with the previous span if it directly follows it in
+ * the input, separated by a single newline.
+ *
+ * \param[in]   offset  offset of line in input file
+ * \param[in]   len     length of line, excluding line ending
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+void assemble_add(uint64_t offset, size_t len)
+{
+    if (spans_count > 0) {
+        span_t *prev = &spans[spans_count - 1];
+
+        if (prev->offset + prev->len + 1 == offset) {
+            prev->len += 1 + len;
+            return;
+        }
+    }
+
+    if (spans_count == spans_size) {
+        size_t  size = spans_size > 0 ? spans_size * 2 : 4096;
+        span_t *tmp  = realloc(spans, size * sizeof *spans);
+
+        if (tmp == NULL) {
+            fprintf(stderr,
+                    "%s(): failed to allocate %zu bytes, exiting.\n",
+                    __func__, size * sizeof *spans);
+            exit(1);
+        }
+        spans      = tmp;
+        spans_size = size;
+    }
+    spans[spans_count].offset = offset;
+    spans[spans_count].len    = len;
+    spans_count++;
+}
+
+
+/** \brief  Write spans to stdout
+ *
+ * Copies the spans from \a fd to stdout in \a njobs parallel chunks, each
+ * written at its offset in the output, the output is preallocated first.
+ * Afterwards the file position of stdout is at the end of the output.
+ *
+ * \param[in]   fd      file descriptor of input file
+ * \param[in]   njobs   number of chunks to copy in parallel
+ *
+ * \return  \c false on I/O error
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+bool assemble_write(int fd, unsigned int njobs)
+{
+    struct stat st;
+    struct stat input_st;
+    off_t       base  = 0;
+    uint64_t    total = 0;
+    bool        ok    = true;
+
+    fflush(stdout);
+    input_fd   = fd;
+    output_fd  = fileno(stdout);
+    positional = fstat(output_fd, &st) == 0 && S_ISREG(st.st_mode)
+        && !(fcntl(output_fd, F_GETFL) & O_APPEND)
+        && (base = lseek(output_fd, 0, SEEK_CUR)) >= 0;
+    if (!positional || njobs == 0) {
+        njobs = 1;
+    }
+    if (njobs > spans_count) {
+        njobs = (unsigned int)spans_count;
+    }
+    if (njobs == 0) {
+        return true;
+    }
+
+    /* map the input, so the spans can be written without copying them */
+    input_map  = NULL;
+    input_size = 0;
+    if (fstat(fd, &input_st) == 0 && S_ISREG(input_st.st_mode) && input_st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)input_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (map != MAP_FAILED) {
+            input_map  = map;
+            input_size = (uint64_t)input_st.st_size;
+        }
+    }
+
+    if (njobs > jobs_size) {
+        job_t *tmp = realloc(jobs, njobs * sizeof *jobs);
+
+        if (tmp == NULL) {
+            fprintf(stderr,
+                    "%s(): failed to allocate %zu bytes, exiting.\n",
+                    __func__, njobs * sizeof *jobs);
+            exit(1);
+        }
+        memset(tmp + jobs_size, 0, (njobs - jobs_size) * sizeof *jobs);
+        jobs      = tmp;
+        jobs_size = njobs;
+    }
+
+    /* prefix sum of the output size of the chunks gives their offsets */
+    for (unsigned int j = 0; j < njobs; j++) {
+        job_t *job = &jobs[j];
+
+        job->first  = spans_count * j / njobs;
+        job->last   = spans_count * (j + 1) / njobs;
+        job->offset = (uint64_t)base + total;
+        for (size_t i = job->first; i < job->last; i++) {
+            total += spans[i].len + 1;
+        }
+        if (input_map == NULL && job->buffer == NULL) {
+            job->buffer = malloc(ASSEMBLE_BUFFER_SIZE);
+            if (job->buffer == NULL) {
+                fprintf(stderr,
+                        "%s(): failed to allocate %d bytes, exiting.\n",
+                        __func__, ASSEMBLE_BUFFER_SIZE);
+                exit(1);
+            }
+        }
+    }
+
+    if (positional) {
+        /* not all file systems support this, it's only an optimization */
+        posix_fallocate(output_fd, base, (off_t)total);
+    }
+
+    for (unsigned int j = 0; j + 1 < njobs; j++) {
+        jobs[j].running = pthread_create(&jobs[j].thread, NULL, job_run, &jobs[j]) == 0;
+        if (!jobs[j].running) {
+            job_run(&jobs[j]);
+        }
+    }
+    job_run(&jobs[njobs - 1]);
+
+    for (unsigned int j = 0; j < njobs; j++) {
+        if (jobs[j].running) {
+            pthread_join(jobs[j].thread, NULL);
+            jobs[j].running = false;
+        }
+        ok = ok && jobs[j].ok;
+    }
+
+    if (positional && lseek(output_fd, base + (off_t)total, SEEK_SET) < 0) {
+        ok = false;
+    }
+    if (input_map != NULL) {
+        munmap((void *)(uintptr_t)input_map, (size_t)input_size);
+        input_map = NULL;
+    }
+    return ok;
+}
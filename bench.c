@@ -0,0 +1,1257 @@
+/** \file   bench.c
+ * \brief   IF stack benchmarks
+ *
+ * Benchmark the if-stack API and the \c stack-test parser on a generated
+ * corpus, reporting throughput and, where available, hardware performance
+ * counters per line. Optionally compare \c stack-test with the C preprocessor
+ * and unifdef on the same corpus.
+ *
+ * The performance fuzzer searches for inputs that are slow to parse and saves
+ * them in a regression corpus, which is replayed by the benchmarks.
+ *
+ * \note    Uses POSIX functions like \c fork() and Linux' \c perf_event_open()
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "ifstack.h"
+#include "metrics.h"
+#include "perfctr.h"
+#include "scan.h"
+
+
+/** \brief  Maximum nesting depth of the generated corpus */
+#define MAX_DEPTH   16
+
+/** \brief  Number of inputs kept by the performance fuzzer */
+#define FUZZ_POPULATION 16
+
+/** \brief  Number of slowest inputs saved by the performance fuzzer */
+#define FUZZ_SAVE       4
+
+
+/** \brief  Corpus line types
+ */
+typedef enum op_e {
+    OP_TEXT,        /**< normal text */
+    OP_IF_TRUE,     /**< 'if true' */
+    OP_IF_FALSE,    /**< 'if false' */
+    OP_ELSE,        /**< 'else' */
+    OP_ENDIF        /**< 'endif' */
+} op_t;
+
+/** \brief  Corpus output syntax
+ */
+typedef enum syntax_e {
+    SYNTAX_IFSTACK,     /**< if/else/endif as parsed by stack-test */
+    SYNTAX_CPP          /**< C preprocessor \#if 1/\#if 0/\#else/\#endif */
+} syntax_t;
+
+/** \brief  Generated corpus
+ */
+typedef struct corpus_s {
+    op_t   *ops;    /**< line types */
+    size_t  lines;  /**< number of lines */
+    size_t  bytes;  /**< size of corpus as text */
+} corpus_t;
+
+
+/** \brief  PRNG state */
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+/** \brief  Path to the stack-test program */
+static const char *stack_test = "./stack-test";
+
+
+/** \brief  Print usage message on stdout
+ *
+ * \param[in]   argv0   content of argv[0]
+ */
+static void usage(char *argv0)
+{
+    printf("usage: %s [--lines <n>] [--iterations <n>] [--stack-test <path>] [--compare]\n"
+           "       [--corpus <dir>] [--fuzz <rounds>] [--fuzz-size <bytes>]\n",
+           basename(argv0));
+    printf("\n");
+    printf("  --compare            compare stack-test with cpp -P and unifdef -k\n");
+    printf("  --corpus <dir>       regression corpus to replay (default perf-corpus)\n");
+    printf("  --fuzz <rounds>      search for slow inputs and save them to the corpus\n");
+    printf("  --fuzz-size <bytes>  maximum size of fuzzer inputs (default 16384)\n");
+    printf("  --lines <n>          lines in generated corpus (default 1000000)\n");
+    printf("  --iterations <n>     iterations of the ifstack API benchmark (default 10)\n");
+    printf("  --stack-test <path>  stack-test binary to benchmark (default ./stack-test)\n");
+}
+
+/** \brief  Get next pseudo random number
+ *
+ * Xorshift64, so corpora are identical across platforms.
+ *
+ * \return  random number
+ */
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/** \brief  Allocate memory, exit on failure
+ *
+ * \param[in]   size    number of bytes to allocate
+ *
+ * \return  pointer to allocated memory
+ */
+static void *bench_malloc(size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (ptr == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, size);
+        exit(1);
+    }
+    return ptr;
+}
+
+/** \brief  Get text of corpus line
+ *
+ * \param[in]   op      line type
+ * \param[in]   syntax  syntax of directives
+ * \param[in]   lineno  line number
+ * \param[out]  buffer  buffer for the text
+ * \param[in]   size    size of \a buffer
+ *
+ * \return  length of text
+ */
+static size_t op_text(op_t op, syntax_t syntax, size_t lineno, char *buffer, size_t size)
+{
+    bool cpp = syntax == SYNTAX_CPP;
+
+    switch (op) {
+        case OP_IF_TRUE:
+            return (size_t)snprintf(buffer, size, cpp ? "#if 1" : "if true");
+        case OP_IF_FALSE:
+            return (size_t)snprintf(buffer, size, cpp ? "#if 0" : "if false");
+        case OP_ELSE:
+            return (size_t)snprintf(buffer, size, cpp ? "#else" : "else");
+        case OP_ENDIF:
+            return (size_t)snprintf(buffer, size, cpp ? "#endif" : "endif");
+        default:
+            return (size_t)snprintf(buffer, size, "    line %zu of generated text", lineno);
+    }
+}
+
+/** \brief  Generate corpus
+ *
+ * Generate a random but well-formed corpus of \a lines lines.
+ *
+ * \param[out]  corpus  corpus
+ * \param[in]   lines   minimum number of lines
+ */
+static void corpus_generate(corpus_t *corpus, size_t lines)
+{
+    bool   in_else[MAX_DEPTH];
+    int    depth = 0;
+    size_t n     = 0;
+    char   text[64];
+
+    corpus->ops   = bench_malloc((lines + MAX_DEPTH) * sizeof *corpus->ops);
+    corpus->bytes = 0;
+
+    while (n < lines || depth > 0) {
+        unsigned int r = (unsigned int)(rng_next() % 100u);
+        op_t         op;
+
+        if (n >= lines) {
+            op = OP_ENDIF;
+        } else if (r < 8 && depth < MAX_DEPTH) {
+            op = OP_IF_TRUE;
+        } else if (r < 16 && depth < MAX_DEPTH) {
+            op = OP_IF_FALSE;
+        } else if (r < 22 && depth > 0 && !in_else[depth - 1]) {
+            op = OP_ELSE;
+        } else if (r < 32 && depth > 0) {
+            op = OP_ENDIF;
+        } else {
+            op = OP_TEXT;
+        }
+
+        switch (op) {
+            case OP_IF_TRUE:    /* fall through */
+            case OP_IF_FALSE:
+                in_else[depth++] = false;
+                break;
+            case OP_ELSE:
+                in_else[depth - 1] = true;
+                break;
+            case OP_ENDIF:
+                depth--;
+                break;
+            default:
+                break;
+        }
+        corpus->ops[n] = op;
+        corpus->bytes += op_text(op, SYNTAX_IFSTACK, n + 1, text, sizeof text) + 1;
+        n++;
+    }
+    corpus->lines = n;
+}
+
+/** \brief  Write corpus to temporary file
+ *
+ * \param[in]   corpus  corpus
+ * \param[in]   syntax  syntax of directives
+ * \param[out]  path    path of temporary file, must be a template for mkstemp()
+ *
+ * \return  \c false on I/O error
+ */
+static bool corpus_write(const corpus_t *corpus, syntax_t syntax, char *path)
+{
+    FILE *fp;
+    int   fd;
+    char  text[64];
+
+    fd = mkstemp(path);
+    if (fd < 0 || (fp = fdopen(fd, "wb")) == NULL) {
+        fprintf(stderr, "error: failed to create \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < corpus->lines; i++) {
+        op_text(corpus->ops[i], syntax, i + 1, text, sizeof text);
+        fprintf(fp, "%s\n", text);
+    }
+    return fclose(fp) == 0;
+}
+
+/** \brief  Print report header
+ */
+static void report_header(void)
+{
+    printf("%-20s %10s %9s %9s %8s %6s %10s %10s %10s\n",
+           "benchmark", "lines", "seconds", "Mlines/s", "MB/s",
+           "IPC", "br-miss/l", "L1-miss/l", "LLC-miss/l");
+}
+
+/** \brief  Print counter value per line, or "n/a" if unavailable
+ *
+ * \param[in]   ctr     counters
+ * \param[in]   index   counter index
+ * \param[in]   lines   number of lines
+ */
+static void report_per_line(const perfctr_t *ctr, int index, double lines)
+{
+    if (perfctr_valid(ctr, index)) {
+        printf(" %10.4f", (double)ctr->value[index] / lines);
+    } else {
+        printf(" %10s", "n/a");
+    }
+}
+
+/** \brief  Print report line for benchmark
+ *
+ * \param[in]   name    benchmark name
+ * \param[in]   lines   number of lines processed
+ * \param[in]   bytes   number of bytes processed
+ * \param[in]   seconds time taken
+ * \param[in]   ctr     counters
+ */
+static void report_result(const char      *name,
+                          double           lines,
+                          double           bytes,
+                          double           seconds,
+                          const perfctr_t *ctr)
+{
+    printf("%-20s %10.0f %9.4f %9.2f %8.1f",
+           name, lines, seconds, lines / seconds / 1e6, bytes / seconds / 1e6);
+    if (perfctr_valid(ctr, PERFCTR_CYCLES) &&
+            perfctr_valid(ctr, PERFCTR_INSTRUCTIONS) &&
+            ctr->value[PERFCTR_CYCLES] > 0) {
+        printf(" %6.2f",
+               (double)ctr->value[PERFCTR_INSTRUCTIONS] /
+               (double)ctr->value[PERFCTR_CYCLES]);
+    } else {
+        printf(" %6s", "n/a");
+    }
+    report_per_line(ctr, PERFCTR_BRANCH_MISSES, lines);
+    report_per_line(ctr, PERFCTR_L1D_MISSES, lines);
+    report_per_line(ctr, PERFCTR_LLC_MISSES, lines);
+    putchar('\n');
+    fflush(stdout);
+}
+
+/** \brief  Benchmark the if-stack API
+ *
+ * Feed the corpus directly to the if-stack API \a iterations times.
+ *
+ * \param[in]   name        benchmark name
+ * \param[in]   corpus      corpus
+ * \param[in]   iterations  number of iterations
+ */
+static void bench_ifstack(const char *name, const corpus_t *corpus, int iterations)
+{
+    perfctr_t    ctr;
+    double       start;
+    double       seconds;
+    unsigned int live = 0;
+
+    ifstack_init();
+    perfctr_open(&ctr, 0);
+    start = metrics_now();
+    perfctr_start(&ctr);
+
+    for (int i = 0; i < iterations; i++) {
+        ifstack_reset();
+        for (size_t n = 0; n < corpus->lines; n++) {
+            switch (corpus->ops[n]) {
+                case OP_IF_TRUE:
+                    ifstack_if(true);
+                    break;
+                case OP_IF_FALSE:
+                    ifstack_if(false);
+                    break;
+                case OP_ELSE:
+                    ifstack_else();
+                    break;
+                case OP_ENDIF:
+                    ifstack_endif();
+                    break;
+                default:
+                    live += ifstack_true();
+                    break;
+            }
+        }
+    }
+
+    perfctr_stop(&ctr);
+    seconds = metrics_now() - start;
+    perfctr_read(&ctr);
+    report_result(name,
+                  (double)corpus->lines * iterations,
+                  (double)corpus->bytes * iterations,
+                  seconds, &ctr);
+    perfctr_close(&ctr);
+    ifstack_free();
+
+    /* keep the compiler from optimizing away the ifstack_true() calls */
+    if (live == 0) {
+        printf("note: no live lines\n");
+    }
+}
+
+/** \brief  Run program and wait for it to finish
+ *
+ * Run \a argv with its output discarded. When \a ctr isn't \c NULL counters
+ * are attached to the child process, counting from its \c exec().
+ *
+ * \param[in]   argv    program and arguments
+ * \param[out]  ctr     counters (optional)
+ * \param[out]  seconds wall clock time taken
+ * \param[out]  maxrss  maximum resident set size in KiB
+ *
+ * \return  exit status of the program or -1 when it couldn't be run
+ */
+static int run_child(const char *const argv[], perfctr_t *ctr, double *seconds, long *maxrss)
+{
+    /* execvp() takes char *const[] for historical reasons, but doesn't
+     * modify the strings */
+    union {
+        const char *const *c;
+        char *const       *v;
+    } args = { argv };
+    struct rusage usage;
+    pid_t         pid;
+    int           sync[2];
+    int           status;
+    double        start;
+    char          go = 0;
+
+    if (pipe(sync) != 0) {
+        fprintf(stderr, "error: failed to create pipe: (%d) %s\n",
+                errno, strerror(errno));
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "error: fork() failed: (%d) %s\n", errno, strerror(errno));
+        close(sync[0]);
+        close(sync[1]);
+        return -1;
+    } else if (pid == 0) {
+        /* child: wait until the counters are attached, then exec */
+        int null = open("/dev/null", O_WRONLY);
+
+        close(sync[1]);
+        if (null < 0 || read(sync[0], &go, 1) != 1) {
+            _exit(127);
+        }
+        close(sync[0]);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execvp(argv[0], args.v);
+        _exit(127);
+    }
+
+    close(sync[0]);
+    if (ctr != NULL) {
+        perfctr_open(ctr, pid);
+    }
+    start = metrics_now();
+    if (write(sync[1], &go, 1) != 1) {
+        fprintf(stderr, "error: failed to start child process\n");
+    }
+    close(sync[1]);
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        return -1;
+    }
+    *seconds = metrics_now() - start;
+    *maxrss  = usage.ru_maxrss;
+    if (ctr != NULL) {
+        perfctr_read(ctr);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/** \brief  Benchmark the stack-test parser
+ *
+ * Run \c stack-test on the corpus file, with its output discarded, counting
+ * from the \c exec() of the child process.
+ *
+ * \param[in]   name    benchmark name
+ * \param[in]   corpus  corpus
+ * \param[in]   path    path to corpus file
+ */
+static void bench_parse(const char *name, const corpus_t *corpus, const char *path)
+{
+    perfctr_t   ctr;
+    double      seconds;
+    long        maxrss;
+    int         status;
+    const char *argv[] = { stack_test, path, NULL };
+
+    if (access(stack_test, X_OK) != 0) {
+        printf("%-20s skipped: \"%s\" not found\n", name, stack_test);
+        return;
+    }
+
+    status = run_child(argv, &ctr, &seconds, &maxrss);
+    if (status != 0) {
+        printf("%-20s failed: \"%s\" exited with status %d\n",
+               name, stack_test, status);
+    } else {
+        report_result(name, (double)corpus->lines, (double)corpus->bytes,
+                      seconds, &ctr);
+    }
+    perfctr_close(&ctr);
+}
+
+/** \brief  Test if program can be found in \c PATH
+ *
+ * \param[in]   name    program name, or path when containing a slash
+ *
+ * \return  \c true if \a name is an executable in \c PATH
+ */
+static bool find_program(const char *name)
+{
+    const char *dirs = getenv("PATH");
+    char        path[4096];
+
+    if (strchr(name, '/') != NULL) {
+        return access(name, X_OK) == 0;
+    }
+    while (dirs != NULL && *dirs != '\0') {
+        const char *end = strchr(dirs, ':');
+        int         len = end != NULL ? (int)(end - dirs) : (int)strlen(dirs);
+
+        snprintf(path, sizeof path, "%.*s/%s", len, len > 0 ? dirs : ".", name);
+        if (access(path, X_OK) == 0) {
+            return true;
+        }
+        dirs = end != NULL ? end + 1 : NULL;
+    }
+    return false;
+}
+
+/** \brief  Compare stack-test with cpp and unifdef
+ *
+ * Time \c stack-test in filter mode against the C preprocessor and unifdef on
+ * the same corpus, converted to \c \#if/\#else/\#endif. Tools not installed
+ * are skipped.
+ *
+ * \param[in]   corpus      corpus
+ * \param[in]   path        path to corpus file
+ * \param[in]   cpp_path    path to corpus file in C preprocessor syntax
+ */
+static void bench_compare(const corpus_t *corpus, const char *path, const char *cpp_path)
+{
+    const char *tools[][6] = {
+        { stack_test, "--filter", path, NULL },
+        { "cpp", "-P", "-x", "c", cpp_path, NULL },
+        { "unifdef", "-k", cpp_path, NULL }
+    };
+    const char *names[] = { "stack-test", "cpp -P", "unifdef -k" };
+    double      reference = 0.0;
+
+    printf("\n%-20s %9s %8s %9s %12s\n",
+           "tool", "seconds", "MB/s", "relative", "max RSS KiB");
+
+    for (size_t i = 0; i < sizeof tools / sizeof tools[0]; i++) {
+        double seconds;
+        double throughput;
+        long   maxrss;
+        int    status;
+
+        if (!find_program(tools[i][0])) {
+            printf("%-20s skipped: not found\n", names[i]);
+            continue;
+        }
+        status = run_child(tools[i], NULL, &seconds, &maxrss);
+        /* unifdef exits with 1 when the output differs from the input */
+        if (status != 0 && !(i == 2 && status == 1)) {
+            printf("%-20s failed: exit status %d\n", names[i], status);
+            continue;
+        }
+
+        throughput = (double)corpus->bytes / seconds;
+        if (i == 0) {
+            reference = throughput;
+        }
+        printf("%-20s %9.4f %8.1f", names[i], seconds, throughput / 1e6);
+        if (reference > 0.0) {
+            printf(" %8.2fx", throughput / reference);
+        } else {
+            printf(" %9s", "n/a");
+        }
+        printf(" %12ld\n", maxrss);
+    }
+}
+
+
+/** \brief  Read file into memory
+ *
+ * \param[in]   path    path to file
+ * \param[out]  len     length of data
+ *
+ * \return  file contents, nul-terminated, or \c NULL on error
+ */
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *fp;
+    char *data;
+    long  size;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    data = bench_malloc((size_t)size + 1);
+    *len = fread(data, 1, (size_t)size, fp);
+    data[*len] = '\0';
+    fclose(fp);
+    return data;
+}
+
+/** \brief  Test if word at \a s matches \a word, ignoring ASCII case
+ *
+ * \param[in]   s       text
+ * \param[in]   word    lower case word
+ *
+ * \return  \c true if \a s starts with \a word followed by whitespace or end of
+ *          the text
+ */
+static bool word_equal(const char *s, const char *word)
+{
+    while (*word != '\0') {
+        if ((*s | 0x20) != *word) {
+            return false;
+        }
+        s++;
+        word++;
+    }
+    return *s == '\0' || *s == ' ' || *s == '\t' || *s == '\r' || *s == '\n';
+}
+
+/** \brief  Load corpus from file
+ *
+ * Classify the lines of \a path the way \c stack-test does, so the file can be
+ * fed to the if-stack API benchmark.
+ *
+ * \param[out]  corpus  corpus
+ * \param[in]   path    path to file
+ *
+ * \return  \c false on I/O error
+ */
+static bool corpus_load(corpus_t *corpus, const char *path)
+{
+    char   *data;
+    char   *s;
+    size_t  len;
+    size_t  lines = 0;
+
+    data = read_file(path, &len);
+    if (data == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        lines += data[i] == '\n';
+    }
+    corpus->ops   = bench_malloc((lines + 1) * sizeof *corpus->ops);
+    corpus->lines = 0;
+    corpus->bytes = len;
+
+    for (s = data; *s != '\0'; ) {
+        char *eol = strchr(s, '\n');
+        op_t  op  = OP_TEXT;
+
+        while (*s == ' ' || *s == '\t') {
+            s++;
+        }
+        if (word_equal(s, "if")) {
+            s += 2;
+            while (*s == ' ' || *s == '\t') {
+                s++;
+            }
+            op = word_equal(s, "0") || word_equal(s, "false") || word_equal(s, "no")
+                 ? OP_IF_FALSE : OP_IF_TRUE;
+        } else if (word_equal(s, "else")) {
+            op = OP_ELSE;
+        } else if (word_equal(s, "endif")) {
+            op = OP_ENDIF;
+        }
+        corpus->ops[corpus->lines++] = op;
+        if (eol == NULL) {
+            break;
+        }
+        s = eol + 1;
+    }
+    free(data);
+    return true;
+}
+
+/** \brief  Replay regression corpus
+ *
+ * Run the if-stack API and parse benchmarks on each file in \a dir, as saved
+ * by the performance fuzzer. Nothing is done if \a dir doesn't exist.
+ *
+ * \param[in]   dir         directory with corpus files
+ * \param[in]   iterations  number of iterations of the if-stack API benchmark
+ */
+static void bench_replay(const char *dir, int iterations)
+{
+    struct dirent **entries;
+    char            path[4096];
+    char            name[300];
+    int             count;
+
+    count = scandir(dir, &entries, NULL, alphasort);
+    if (count < 0) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        struct dirent *entry = entries[i];
+        corpus_t       corpus;
+
+        if (entry->d_name[0] == '.') {
+            free(entry);
+            continue;
+        }
+        snprintf(path, sizeof path, "%s/%s", dir, entry->d_name);
+        if (corpus_load(&corpus, path) && corpus.lines > 0) {
+            snprintf(name, sizeof name, "api:%s", entry->d_name);
+            bench_ifstack(name, &corpus, iterations);
+            snprintf(name, sizeof name, "parse:%s", entry->d_name);
+            bench_parse(name, &corpus, path);
+            free(corpus.ops);
+        }
+        free(entry);
+    }
+    free(entries);
+}
+
+/** \brief  Benchmark the newline counters
+ *
+ * Count the newlines of the corpus file \a iterations times with the kernel
+ * of each CPU level the machine supports, then split it into \a nchunks
+ * chunks of lines that are counted in parallel with the best kernel, whose
+ * level is in the name of the result.
+ *
+ * \param[in]   corpus      corpus
+ * \param[in]   path        path to corpus file
+ * \param[in]   iterations  number of iterations
+ * \param[in]   nchunks     number of chunks for the parallel count
+ */
+static void bench_newlines(const corpus_t *corpus, const char *path, int iterations,
+                           unsigned int nchunks)
+{
+    static const char *const levels[] = { "generic", "sse2", "avx2" };
+    perfctr_t    ctr;
+    char         name[64];
+    char        *data;
+    size_t       len;
+    size_t      *offsets;
+    uint64_t    *lines;
+    uint64_t     count = 0;
+    double       start;
+    double       seconds;
+
+    data = read_file(path, &len);
+    if (data == NULL) {
+        fprintf(stderr, "error: failed to read \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        return;
+    }
+
+    for (size_t l = 0; l < sizeof levels / sizeof levels[0]; l++) {
+        if (!scan_init(levels[l])) {
+            continue;
+        }
+        perfctr_open(&ctr, 0);
+        start = metrics_now();
+        perfctr_start(&ctr);
+        for (int i = 0; i < iterations; i++) {
+            count = scan_lines(data, len);
+        }
+        perfctr_stop(&ctr);
+        seconds = metrics_now() - start;
+        perfctr_read(&ctr);
+        snprintf(name, sizeof name, "newlines-%s", levels[l]);
+        if (count != corpus->lines) {
+            printf("%-20s failed: counted %" PRIu64 " lines\n", name, count);
+        } else {
+            report_result(name,
+                          (double)corpus->lines * iterations,
+                          (double)len * iterations,
+                          seconds, &ctr);
+        }
+        perfctr_close(&ctr);
+    }
+
+    /* parallel, the counters are inherited by the threads */
+    scan_init(NULL);
+    offsets = bench_malloc(nchunks * sizeof *offsets);
+    lines   = bench_malloc(nchunks * sizeof *lines);
+    perfctr_open(&ctr, 0);
+    start = metrics_now();
+    perfctr_start(&ctr);
+    for (int i = 0; i < iterations; i++) {
+        count = scan_chunks(data, len, nchunks, offsets, lines);
+    }
+    perfctr_stop(&ctr);
+    seconds = metrics_now() - start;
+    perfctr_read(&ctr);
+    snprintf(name, sizeof name, "newlines-x%u-%s", nchunks, scan_level());
+    if (count != corpus->lines) {
+        printf("%-20s failed: counted %" PRIu64 " lines\n", name, count);
+    } else {
+        for (unsigned int c = 0; c < nchunks; c++) {
+            /* each chunk starts at line lines[c] + 1 */
+            if (offsets[c] < len && scan_lines(data, offsets[c]) != lines[c]) {
+                printf("%-20s failed: chunk %u starts at the wrong line\n", name, c);
+                count = 0;
+                break;
+            }
+        }
+        if (count != 0) {
+            report_result(name,
+                          (double)corpus->lines * iterations,
+                          (double)len * iterations,
+                          seconds, &ctr);
+        }
+    }
+    perfctr_close(&ctr);
+    free(offsets);
+    free(lines);
+    free(data);
+}
+
+/** \brief  Input evaluated by the performance fuzzer
+ */
+typedef struct fuzz_input_s {
+    char   *data;           /**< input text */
+    size_t  len;            /**< length of \c data */
+    double  ns_per_byte;    /**< parse time per byte of input */
+    long    maxrss;         /**< peak memory use in KiB */
+} fuzz_input_t;
+
+/** \brief  Lines inserted by the fuzzer's mutations */
+static const char *fuzz_snippets[] = {
+    "if true\n", "if false\n", "IF 0\n", "else\n", "endif\n",
+    "text\n", "\n", "    indented text line\n"
+};
+
+/** \brief  Get random number below \a n
+ *
+ * \param[in]   n   upper bound (exclusive), must be > 0
+ *
+ * \return  random number
+ */
+static size_t rng_below(size_t n)
+{
+    return (size_t)(rng_next() % n);
+}
+
+/** \brief  Get offset of the start of a random line
+ *
+ * \param[in]   input   input
+ *
+ * \return  offset of start of line, or \c input->len
+ */
+static size_t fuzz_line_start(const fuzz_input_t *input)
+{
+    size_t pos = rng_below(input->len + 1);
+
+    while (pos > 0 && input->data[pos - 1] != '\n') {
+        pos--;
+    }
+    return pos;
+}
+
+/** \brief  Get offset of the start of the line following \a pos
+ *
+ * \param[in]   input   input
+ * \param[in]   pos     offset in input
+ *
+ * \return  offset of start of next line, or \c input->len
+ */
+static size_t fuzz_line_end(const fuzz_input_t *input, size_t pos)
+{
+    while (pos < input->len && input->data[pos] != '\n') {
+        pos++;
+    }
+    return pos < input->len ? pos + 1 : pos;
+}
+
+/** \brief  Insert text into input
+ *
+ * \param[in,out]   input   input
+ * \param[in]       pos     offset to insert at
+ * \param[in]       text    text to insert
+ * \param[in]       len     length of \a text
+ */
+static void fuzz_insert(fuzz_input_t *input, size_t pos, const char *text, size_t len)
+{
+    char *data = bench_malloc(input->len + len + 1);
+
+    memcpy(data, input->data, pos);
+    memcpy(data + pos, text, len);
+    memcpy(data + pos + len, input->data + pos, input->len - pos + 1);
+    free(input->data);
+    input->data = data;
+    input->len += len;
+}
+
+/** \brief  Apply random mutation to input
+ *
+ * The result is truncated to at most \a max_len bytes, at a line boundary.
+ *
+ * \param[in,out]   input   input
+ * \param[in]       max_len maximum length of input
+ */
+static void fuzz_mutate(fuzz_input_t *input, size_t max_len)
+{
+    size_t      a = fuzz_line_start(input);
+    size_t      b = fuzz_line_end(input, a);
+    const char *snippet;
+    char        line[256];
+
+    switch (rng_below(6)) {
+        case 0:
+            /* insert directive or text */
+            snippet = fuzz_snippets[rng_below(sizeof fuzz_snippets / sizeof fuzz_snippets[0])];
+            fuzz_insert(input, a, snippet, strlen(snippet));
+            break;
+        case 1:
+            /* delete line */
+            memmove(input->data + a, input->data + b, input->len - b + 1);
+            input->len -= b - a;
+            break;
+        case 2: {
+            /* duplicate a block of lines */
+            size_t  end  = a;
+            size_t  n    = 1 + rng_below(64);
+            char   *copy;
+
+            while (n-- > 0) {
+                end = fuzz_line_end(input, end);
+            }
+            copy = bench_malloc(end - a + 1);
+            memcpy(copy, input->data + a, end - a);
+            fuzz_insert(input, fuzz_line_start(input), copy, end - a);
+            free(copy);
+            break;
+        }
+        case 3:
+            /* wrap line in a new IF .. ENDIF */
+            snippet = rng_below(2) ? "if true\n" : "if false\n";
+            fuzz_insert(input, b, "endif\n", 6);
+            fuzz_insert(input, a, snippet, strlen(snippet));
+            break;
+        case 4: {
+            /* insert long line */
+            size_t n = 1 + rng_below(sizeof line - 2);
+
+            memset(line, rng_below(2) ? ' ' : 'x', n);
+            line[n] = '\n';
+            fuzz_insert(input, a, line, n + 1);
+            break;
+        }
+        default:
+            /* insert nested IFs */
+            for (size_t n = 1 + rng_below(16); n > 0; n--) {
+                fuzz_insert(input, a, "if true\n", 8);
+            }
+            break;
+    }
+
+    /* truncate to max_len at a line boundary */
+    if (input->len > max_len) {
+        size_t len = max_len;
+
+        while (len > 0 && input->data[len - 1] != '\n') {
+            len--;
+        }
+        input->len       = len;
+        input->data[len] = '\0';
+    }
+}
+
+/** \brief  Measure cost of input
+ *
+ * Run \c stack-test on \a input three times, taking the fastest parse time as
+ * reported in its metrics (excluding process startup) and the largest peak
+ * memory use.
+ *
+ * \param[in,out]   input       input
+ * \param[in]       path        path of temporary file for the input
+ * \param[in]       prom_path   path of temporary file for the metrics
+ *
+ * \return  \c false on error
+ */
+static bool fuzz_measure(fuzz_input_t *input, const char *path, const char *prom_path)
+{
+    const char *argv[] = { stack_test, "--metrics", prom_path, path, NULL };
+    double      best   = 0.0;
+    FILE       *fp;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(input->data, 1, input->len, fp) != input->len) {
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return false;
+    }
+    fclose(fp);
+
+    input->maxrss = 0;
+    for (int run = 0; run < 3; run++) {
+        double  seconds;
+        long    maxrss;
+        char   *prom;
+        char   *value;
+        size_t  len;
+
+        if (run_child(argv, NULL, &seconds, &maxrss) < 0) {
+            return false;
+        }
+        prom = read_file(prom_path, &len);
+        if (prom == NULL) {
+            return false;
+        }
+        value = strstr(prom, "\nifstack_parse_seconds_total ");
+        if (value != NULL) {
+            seconds = strtod(value + sizeof "\nifstack_parse_seconds_total " - 1, NULL);
+            if (run == 0 || seconds < best) {
+                best = seconds;
+            }
+        }
+        free(prom);
+        if (maxrss > input->maxrss) {
+            input->maxrss = maxrss;
+        }
+    }
+    input->ns_per_byte = input->len > 0 ? best * 1e9 / (double)input->len : 0.0;
+    return true;
+}
+
+/** \brief  Save fuzzer input to the regression corpus
+ *
+ * \param[in]   input   input
+ * \param[in]   dir     corpus directory
+ * \param[in]   name    file name
+ */
+static void fuzz_save(const fuzz_input_t *input, const char *dir, const char *name)
+{
+    char  path[4096];
+    FILE *fp;
+
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "error: failed to create \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        return;
+    }
+    fwrite(input->data, 1, input->len, fp);
+    fclose(fp);
+    printf("saved %-24s %8zu bytes %9.2f ns/byte %8ld KiB\n",
+           name, input->len, input->ns_per_byte, input->maxrss);
+}
+
+/** \brief  Search for inputs that make stack-test slow
+ *
+ * Simple evolutionary search: a population of inputs is repeatedly mutated,
+ * keeping the mutants that take the most time per byte to parse. The slowest
+ * inputs and the input using the most memory are saved to \a dir.
+ *
+ * \param[in]   rounds  number of mutants to evaluate
+ * \param[in]   max_len maximum size of an input
+ * \param[in]   dir     corpus directory
+ *
+ * \return  \c false on error
+ */
+static bool fuzz(long rounds, size_t max_len, const char *dir)
+{
+    fuzz_input_t pop[FUZZ_POPULATION];
+    fuzz_input_t memory;
+    char         path[]      = "/tmp/ifstack-fuzz-XXXXXX";
+    char         prom_path[] = "/tmp/ifstack-fuzz-XXXXXX";
+    int          fd_path;
+    int          fd_metrics;
+    int          seeded      = 0;
+    bool         result      = false;
+
+    fd_path    = mkstemp(path);
+    fd_metrics = mkstemp(prom_path);
+    if (fd_path < 0 || fd_metrics < 0) {
+        fprintf(stderr, "error: failed to create temporary files\n");
+        return false;
+    }
+    close(fd_path);
+    close(fd_metrics);
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "error: failed to create \"%s\": (%d) %s\n",
+                dir, errno, strerror(errno));
+        goto cleanup;
+    }
+
+    /* seed the population with generated corpora */
+    for (int i = 0; i < FUZZ_POPULATION; i++) {
+        corpus_t corpus;
+        char     text[64];
+
+        corpus_generate(&corpus, max_len / 32);
+        pop[i].data = bench_malloc(corpus.bytes + 1);
+        pop[i].len  = 0;
+        for (size_t n = 0; n < corpus.lines; n++) {
+            size_t len = op_text(corpus.ops[n], SYNTAX_IFSTACK, n + 1, text, sizeof text);
+
+            memcpy(pop[i].data + pop[i].len, text, len);
+            pop[i].len += len;
+            pop[i].data[pop[i].len++] = '\n';
+        }
+        pop[i].data[pop[i].len] = '\0';
+        free(corpus.ops);
+        seeded++;
+        if (!fuzz_measure(&pop[i], path, prom_path)) {
+            fprintf(stderr, "error: failed to run \"%s\"\n", stack_test);
+            goto cleanup;
+        }
+    }
+    memory = pop[0];
+    memory.data = bench_malloc(pop[0].len + 1);
+    memcpy(memory.data, pop[0].data, pop[0].len + 1);
+
+    for (long round = 1; round <= rounds; round++) {
+        fuzz_input_t  mutant;
+        fuzz_input_t *parent = &pop[rng_below(FUZZ_POPULATION)];
+        int           fastest = 0;
+
+        mutant      = *parent;
+        mutant.data = bench_malloc(parent->len + 1);
+        memcpy(mutant.data, parent->data, parent->len + 1);
+        for (size_t n = 1 + rng_below(4); n > 0; n--) {
+            fuzz_mutate(&mutant, max_len);
+        }
+        if (mutant.len == 0 || !fuzz_measure(&mutant, path, prom_path)) {
+            free(mutant.data);
+            continue;
+        }
+
+        if (mutant.maxrss > memory.maxrss) {
+            free(memory.data);
+            memory      = mutant;
+            memory.data = bench_malloc(mutant.len + 1);
+            memcpy(memory.data, mutant.data, mutant.len + 1);
+        }
+
+        /* replace the fastest member of the population if the mutant is slower */
+        for (int i = 1; i < FUZZ_POPULATION; i++) {
+            if (pop[i].ns_per_byte < pop[fastest].ns_per_byte) {
+                fastest = i;
+            }
+        }
+        if (mutant.ns_per_byte > pop[fastest].ns_per_byte) {
+            free(pop[fastest].data);
+            pop[fastest] = mutant;
+        } else {
+            free(mutant.data);
+        }
+
+        if (round % 100 == 0) {
+            double worst = 0.0;
+
+            for (int i = 0; i < FUZZ_POPULATION; i++) {
+                if (pop[i].ns_per_byte > worst) {
+                    worst = pop[i].ns_per_byte;
+                }
+            }
+            printf("round %6ld: worst %9.2f ns/byte, peak memory %ld KiB\n",
+                   round, worst, memory.maxrss);
+            fflush(stdout);
+        }
+    }
+
+    /* save slowest inputs, slowest first */
+    for (int i = 0; i < FUZZ_SAVE; i++) {
+        int  slowest = 0;
+        char name[64];
+
+        for (int k = 1; k < FUZZ_POPULATION; k++) {
+            if (pop[k].ns_per_byte > pop[slowest].ns_per_byte) {
+                slowest = k;
+            }
+        }
+        snprintf(name, sizeof name, "slow-%02d.txt", i + 1);
+        fuzz_save(&pop[slowest], dir, name);
+        pop[slowest].ns_per_byte = -1.0;
+    }
+    fuzz_save(&memory, dir, "memory.txt");
+    free(memory.data);
+    result = true;
+
+cleanup:
+    for (int i = 0; i < seeded; i++) {
+        free(pop[i].data);
+    }
+    remove(path);
+    remove(prom_path);
+    return result;
+}
+
+
+/** \brief  Benchmark driver
+ *
+ * \param[in]   argc    argument count
+ * \param[in]   argv    argument vector
+ *
+ * \return  \c EXIT_SUCCESS on success, \c EXIT_FAILURE on failure
+ */
+int main(int argc, char *argv[])
+{
+    corpus_t    corpus;
+    char        path[]     = "/tmp/ifstack-bench-XXXXXX";
+    char        cpp_path[] = "/tmp/ifstack-bench-XXXXXX";
+    const char *corpus_dir = "perf-corpus";
+    long        lines      = 1000000;
+    long        iterations = 10;
+    long        rounds     = 0;
+    long        fuzz_size  = 16384;
+    bool        compare    = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        } else if (strcmp(argv[i], "--compare") == 0) {
+            compare = true;
+        } else if (i + 1 >= argc) {
+            fprintf(stderr, "error: unknown option or missing argument '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        } else if (strcmp(argv[i], "--lines") == 0) {
+            lines = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--iterations") == 0) {
+            iterations = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--stack-test") == 0) {
+            stack_test = argv[++i];
+        } else if (strcmp(argv[i], "--corpus") == 0) {
+            corpus_dir = argv[++i];
+        } else if (strcmp(argv[i], "--fuzz") == 0) {
+            rounds = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--fuzz-size") == 0) {
+            fuzz_size = strtol(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "error: unknown option '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (lines <= 0 || iterations <= 0 || fuzz_size <= 0) {
+        fprintf(stderr, "error: --lines, --iterations and --fuzz-size must be positive\n");
+        return EXIT_FAILURE;
+    }
+    if (rounds > 0) {
+        return fuzz(rounds, (size_t)fuzz_size, corpus_dir) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    corpus_generate(&corpus, (size_t)lines);
+    if (!corpus_write(&corpus, SYNTAX_IFSTACK, path)) {
+        free(corpus.ops);
+        return EXIT_FAILURE;
+    }
+    scan_init(NULL);
+    printf("corpus: %zu lines, %zu bytes, max depth %d\n",
+           corpus.lines, corpus.bytes, MAX_DEPTH);
+    printf("scanning kernels: %s\n\n", scan_level());
+
+    report_header();
+    bench_ifstack("ifstack-api", &corpus, (int)iterations);
+    bench_parse("parse", &corpus, path);
+    bench_newlines(&corpus, path, (int)iterations, 4);
+    bench_replay(corpus_dir, (int)iterations);
+
+    if (compare && corpus_write(&corpus, SYNTAX_CPP, cpp_path)) {
+        bench_compare(&corpus, path, cpp_path);
+        remove(cpp_path);
+    }
+
+    remove(path);
+    free(corpus.ops);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,727 @@
+/** \file   eval.c
+ * \brief   Line evaluator
+ *
+ * Lexes lines of input, handles the directives using the if-stack and decides
+ * which lines of text are live. Evaluation is pull-based: the caller asks for
+ * the next line or the next span of live text, and only as much of the input
+ * is read and evaluated as is needed to produce it.
+ *
+ * Uses the if-stack of the calling thread and keeps the state of the line
+ * being evaluated per thread like the if-stack does, so with C11 each thread
+ * can evaluate one file at a time; see \c IFSTACK_PER_THREAD.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ifstack.h"
+#include "match.h"
+#include "profile.h"
+#include "reader.h"
+#include "symbols.h"
+#include "eval.h"
+
+/** \brief  Boolean value translation
+ */
+typedef struct bvalue_s {
+    const char *text;   /**< text */
+    bool        value;  /**< boolean value */
+} bvalue_t;
+
+
+/** \brief  Byte classes for the lexer
+ *
+ * Bit flags, used in \c byte_class[].
+ */
+enum {
+    BC_SPACE = 0x01,    /**< whitespace (C locale \c isspace()) */
+    BC_UPPER = 0x02     /**< ASCII upper case letter */
+};
+
+
+/** \brief  Byte classification table
+ *
+ * Locale-independent replacement of the \c <ctype.h> functions: bytes >= 0x80
+ * (UTF-8 sequences) are never whitespace or letters.
+ */
+static const unsigned char byte_class[256] = {
+    ['\t'] = BC_SPACE, ['\n'] = BC_SPACE, ['\v'] = BC_SPACE,
+    ['\f'] = BC_SPACE, ['\r'] = BC_SPACE, [' ']  = BC_SPACE,
+
+    ['A'] = BC_UPPER, ['B'] = BC_UPPER, ['C'] = BC_UPPER, ['D'] = BC_UPPER,
+    ['E'] = BC_UPPER, ['F'] = BC_UPPER, ['G'] = BC_UPPER, ['H'] = BC_UPPER,
+    ['I'] = BC_UPPER, ['J'] = BC_UPPER, ['K'] = BC_UPPER, ['L'] = BC_UPPER,
+    ['M'] = BC_UPPER, ['N'] = BC_UPPER, ['O'] = BC_UPPER, ['P'] = BC_UPPER,
+    ['Q'] = BC_UPPER, ['R'] = BC_UPPER, ['S'] = BC_UPPER, ['T'] = BC_UPPER,
+    ['U'] = BC_UPPER, ['V'] = BC_UPPER, ['W'] = BC_UPPER, ['X'] = BC_UPPER,
+    ['Y'] = BC_UPPER, ['Z'] = BC_UPPER
+};
+
+/** \brief  Test if byte is whitespace
+ *
+ * \param[in]   c   byte
+ */
+#define IS_SPACE(c) (byte_class[(unsigned char)(c)] & BC_SPACE)
+
+/** \brief  Convert byte to ASCII lower case
+ *
+ * \param[in]   c   byte
+ */
+#define TO_LOWER(c) ((unsigned char)(c) | ((byte_class[(unsigned char)(c)] & BC_UPPER) << 4))
+
+
+/** \brief  Value of a SWITCH statement
+ */
+typedef struct switch_value_s {
+    char     *value;    /**< value */
+    size_t    len;      /**< length of \c value */
+    size_t    size;     /**< number of bytes allocated for \c value */
+    uint32_t  hash;     /**< hash of \c value, compared first with CASE labels */
+} switch_value_t;
+
+
+/** \brief  Line read from file for processing */
+static IFSTACK_THREAD_LOCAL const char *line;
+
+/** \brief  Current token in \c line */
+static IFSTACK_THREAD_LOCAL const char *token;
+
+/** \brief  Length of current token */
+static IFSTACK_THREAD_LOCAL size_t token_len;
+
+/** \brief  Argument of the last directive, as written, for the profile */
+static IFSTACK_THREAD_LOCAL const char *arg;
+
+/** \brief  Length of \c arg */
+static IFSTACK_THREAD_LOCAL size_t arg_len;
+
+
+/** \brief  Values of the unclosed SWITCH statements, innermost last
+ *
+ * Entries and their value buffers are kept when the SWITCH is closed, to be
+ * reused by the next SWITCH at the same depth.
+ */
+static IFSTACK_THREAD_LOCAL switch_value_t *switches;
+
+/** \brief  Number of entries allocated in \c switches */
+static IFSTACK_THREAD_LOCAL unsigned int switches_size;
+
+/** \brief  Number of unclosed SWITCH statements */
+static IFSTACK_THREAD_LOCAL unsigned int switches_count;
+
+/** \brief  Table of words to translate to boolean values
+ */
+static const bvalue_t booleans[] = {
+    { "0",      false },
+    { "1",      true  },
+    { "false",  false },
+    { "true",   true  },
+    { "no",     false },
+    { "yes",    true  }
+};
+
+/** \brief  Messages for the evaluation statuses */
+static const char *status_messages[] = {
+    "OK",
+    "invalid or missing directive argument",
+    "directive invalid on the stack"
+};
+
+
+/** \brief  Compare current token with word ignoring ASCII case
+ *
+ * Locale-independent replacement of \c strcasecmp(3), only checking for
+ * equality.
+ *
+ * \param[in]   word    word to compare with
+ *
+ * \return  \c true if \c token equals \a word ignoring ASCII case
+ */
+static bool token_equal(const char *word)
+{
+    for (size_t i = 0; i < token_len; i++) {
+        if (TO_LOWER(token[i]) != TO_LOWER(word[i])) {
+            return false;
+        }
+    }
+    return word[token_len] == '\0';
+}
+
+/** \brief  Check if current token starts a \c match() predicate
+ *
+ * \return  \c true if \c token starts with "match(", ignoring ASCII case
+ */
+static bool token_is_match(void)
+{
+    static const char prefix[] = "match(";
+
+    for (size_t i = 0; i < sizeof prefix - 1; i++) {
+        if (i >= token_len || TO_LOWER(token[i]) != (unsigned char)prefix[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** \brief  Get token from current line
+ *
+ * Sets \c token and \c token_len to the next token in \c line.
+ *
+ * \param[in,out]   posp    position in \c line, set to the position of the
+ *                          first whitespace character after the token
+ *
+ * \return  \c false when no token was encountered
+ */
+static bool get_token(size_t *posp)
+{
+    size_t pos = *posp;
+
+    /* skip whitespace */
+    while (line[pos] != '\0' && IS_SPACE(line[pos])) {
+        pos++;
+    }
+    token = line + pos;
+    if (line[pos] == '\0') {
+        /* no token */
+        token_len = 0;
+        return false;
+    }
+
+    while (line[pos] != '\0' && !IS_SPACE(line[pos])) {
+        pos++;
+    }
+    token_len = (size_t)(line + pos - token);
+    *posp     = pos;
+    return true;
+}
+
+/** \brief  Replace current token by the value of the symbol it names
+ *
+ * Tokens that don't name a defined symbol are used literally.
+ */
+static void resolve_token(void)
+{
+    size_t      len;
+    const char *value = symbols_lookup(token, token_len, &len);
+
+    if (value != NULL) {
+        token     = value;
+        token_len = len;
+    }
+}
+
+/** \brief  Skip whitespace in current line
+ *
+ * \param[in]   pos position in \c line
+ *
+ * \return  position of the first non-whitespace character at or after \a pos
+ */
+static size_t skip_space(size_t pos)
+{
+    while (line[pos] != '\0' && IS_SPACE(line[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+/** \brief  Evaluate \c match(NAME, "pattern") predicate
+ *
+ * True when the value of symbol \c NAME matches the POSIX extended regular
+ * expression \c pattern, false when \c NAME isn't defined. Compiled patterns
+ * are cached, see match.c. Sets \c arg and \c arg_len to the predicate.
+ *
+ * \param[in]   pos     position in \c line of the opening parenthesis
+ * \param[out]  state   result
+ *
+ * \return  evaluation status
+ */
+static int handle_match(size_t pos, bool *state)
+{
+    const char *name;
+    size_t      name_len;
+    const char *pattern;
+    size_t      pattern_len;
+    const char *value;
+    size_t      value_len;
+
+    /* NAME */
+    pos  = skip_space(pos + 1);
+    name = line + pos;
+    while (line[pos] != '\0' && line[pos] != ',' && line[pos] != ')' && !IS_SPACE(line[pos])) {
+        pos++;
+    }
+    name_len = (size_t)(line + pos - name);
+    pos      = skip_space(pos);
+    if (name_len == 0 || line[pos] != ',') {
+        fprintf(stderr, "%s(): error: expected 'match(NAME, \"pattern\")'\n", __func__);
+        return EVAL_ERR_ARGUMENT;
+    }
+
+    /* "pattern", with \" for a quote and \\ for a backslash, see match.c */
+    pos = skip_space(pos + 1);
+    if (line[pos] != '"') {
+        fprintf(stderr, "%s(): error: expected quoted pattern in 'match()'\n", __func__);
+        return EVAL_ERR_ARGUMENT;
+    }
+    pattern = line + ++pos;
+    while (line[pos] != '\0' && line[pos] != '"') {
+        if (line[pos] == '\\' && line[pos + 1] != '\0') {
+            pos++;
+        }
+        pos++;
+    }
+    pattern_len = (size_t)(line + pos - pattern);
+    if (line[pos] != '"') {
+        fprintf(stderr, "%s(): error: unterminated pattern in 'match()'\n", __func__);
+        return EVAL_ERR_ARGUMENT;
+    }
+    pos = skip_space(pos + 1);
+    if (line[pos] != ')') {
+        fprintf(stderr, "%s(): error: expected ')' after pattern in 'match()'\n", __func__);
+        return EVAL_ERR_ARGUMENT;
+    }
+    arg_len = (size_t)(line + pos + 1 - arg);
+
+    /* the pattern is checked even when the symbol isn't defined */
+    value = symbols_lookup(name, name_len, &value_len);
+    if (!match_test(pattern, pattern_len, value != NULL ? value : "", state)) {
+        return EVAL_ERR_ARGUMENT;
+    }
+    if (value == NULL) {
+        *state = false;
+    }
+    return EVAL_OK;
+}
+
+/** \brief  Handle IF statement
+ *
+ * The condition is a boolean word, a symbol whose value is one, or a
+ * \c match() predicate.
+ *
+ * \param[in]   pos position in \c line after 'if'
+ *
+ * \return  evaluation status
+ */
+static int handle_if(size_t pos)
+{
+    bool state = true;  /* anything not explicitly false will be considered true */
+
+    if (!get_token(&pos)) {
+        fprintf(stderr, "%s(): error: expected token after 'IF'\n", __func__);
+        return EVAL_ERR_ARGUMENT;
+    }
+    arg     = token;
+    arg_len = token_len;
+
+    if (token_is_match()) {
+        int status = handle_match((size_t)(token - line) + 5, &state);
+
+        if (status != EVAL_OK) {
+            return status;
+        }
+    } else {
+        resolve_token();
+        for (size_t i = 0; i < sizeof booleans / sizeof booleans[0]; i++) {
+            if (token_equal(booleans[i].text)) {
+                state = booleans[i].value;
+                break;
+            }
+        }
+    }
+
+    ifstack_if(state);
+    return EVAL_OK;
+}
+
+/** \brief  Handle SWITCH statement
+ *
+ * The SWITCH's value is the value of the symbol named by its argument, or the
+ * argument itself if no such symbol is defined. The value is hashed once here,
+ * so each CASE compares a hash before comparing strings.
+ *
+ * \param[in]   pos position in \c line after 'switch'
+ *
+ * \return  evaluation status
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static int handle_switch(size_t pos)
+{
+    switch_value_t *sw;
+
+    if (!get_token(&pos)) {
+        fprintf(stderr, "%s(): error: expected token after 'SWITCH'\n", __func__);
+        return EVAL_ERR_ARGUMENT;
+    }
+    arg     = token;
+    arg_len = token_len;
+    resolve_token();
+
+    if (switches_count == switches_size) {
+        unsigned int    size = switches_size > 0 ? switches_size * 2 : 16;
+        switch_value_t *tmp  = realloc(switches, size * sizeof *switches);
+
+        if (tmp == NULL) {
+            fprintf(stderr,
+                    "%s(): failed to allocate %zu bytes, exiting.\n",
+                    __func__, size * sizeof *switches);
+            exit(1);
+        }
+        memset(tmp + switches_size, 0, (size - switches_size) * sizeof *switches);
+        switches      = tmp;
+        switches_size = size;
+    }
+
+    sw = &switches[switches_count++];
+    if (sw->size < token_len) {
+        char *value = realloc(sw->value, token_len);
+
+        if (value == NULL) {
+            fprintf(stderr,
+                    "%s(): failed to allocate %zu bytes, exiting.\n",
+                    __func__, token_len);
+            exit(1);
+        }
+        sw->value = value;
+        sw->size  = token_len;
+    }
+    memcpy(sw->value, token, token_len);
+    sw->len  = token_len;
+    sw->hash = symbols_hash(token, token_len);
+
+    ifstack_switch();
+    return EVAL_OK;
+}
+
+/** \brief  Handle CASE statement
+ *
+ * \param[in]   pos position in \c line after 'case'
+ *
+ * \return  evaluation status
+ */
+static int handle_case(size_t pos)
+{
+    bool match = false;
+
+    if (!get_token(&pos)) {
+        fprintf(stderr, "%s(): error: expected token after 'CASE'\n", __func__);
+        return EVAL_ERR_ARGUMENT;
+    }
+    arg     = token;
+    arg_len = token_len;
+    if (switches_count > 0) {
+        const switch_value_t *sw = &switches[switches_count - 1];
+
+        match = sw->hash == symbols_hash(token, token_len)
+            && sw->len == token_len
+            && memcmp(sw->value, token, token_len) == 0;
+    }
+
+    return ifstack_case(match) ? EVAL_OK : EVAL_ERR_STACK;
+}
+
+/** \brief  Handle ENDSWITCH statement
+ *
+ * \return  evaluation status
+ */
+static int handle_endswitch(void)
+{
+    if (!ifstack_endswitch()) {
+        return EVAL_ERR_STACK;
+    }
+    switches_count--;
+    return EVAL_OK;
+}
+
+/** \brief  Evaluate current line
+ *
+ * \param[out]  kind    kind of line
+ *
+ * \return  evaluation status
+ */
+static int handle_line(int *kind)
+{
+    size_t pos = 0;
+
+    *kind = EVAL_TEXT;
+    if (!get_token(&pos)) {
+        /* empty line */
+        return EVAL_OK;
+    }
+
+    if (token_equal("if")) {
+        *kind = EVAL_IF;
+        return handle_if(pos);
+    } else if (token_equal("else")) {
+        *kind = EVAL_ELSE;
+        return ifstack_else() ? EVAL_OK : EVAL_ERR_STACK;
+    } else if (token_equal("endif")) {
+        *kind = EVAL_ENDIF;
+        return ifstack_endif() ? EVAL_OK : EVAL_ERR_STACK;
+    } else if (token_equal("switch")) {
+        *kind = EVAL_SWITCH;
+        return handle_switch(pos);
+    } else if (token_equal("case")) {
+        *kind = EVAL_CASE;
+        return handle_case(pos);
+    } else if (token_equal("default")) {
+        *kind = EVAL_DEFAULT;
+        return ifstack_default() ? EVAL_OK : EVAL_ERR_STACK;
+    } else if (token_equal("endswitch")) {
+        *kind = EVAL_ENDSWITCH;
+        return handle_endswitch();
+    }
+    return EVAL_OK;
+}
+
+
+/** \brief  Update the profile for the current line
+ *
+ * \param[in]   el  evaluated line
+ */
+static void profile_line(const eval_line_t *el)
+{
+    switch (el->kind) {
+        case EVAL_TEXT:
+            profile_text(el->live, el->len + 1u);
+            break;
+        case EVAL_IF:
+            profile_enter("if", arg, arg_len);
+            break;
+        case EVAL_ELSE:
+            profile_branch("else", NULL, 0);
+            break;
+        case EVAL_SWITCH:
+            profile_enter("switch", arg, arg_len);
+            break;
+        case EVAL_CASE:
+            profile_branch("case", arg, arg_len);
+            break;
+        case EVAL_DEFAULT:
+            profile_branch("default", NULL, 0);
+            break;
+        case EVAL_ENDIF:    /* fall through */
+        case EVAL_ENDSWITCH:
+            profile_leave();
+            break;
+        default:
+            break;
+    }
+}
+
+
+/** \brief  Initialize iterator
+ *
+ * Also initializes the if-stack.
+ *
+ * \param[out]  iter    iterator
+ */
+void eval_iter_init(eval_iter_t *iter)
+{
+    memset(iter, 0, sizeof *iter);
+    reader_init(&iter->reader);
+    ifstack_init();
+}
+
+
+/** \brief  Reset state for a new file
+ *
+ * \param[in,out]   iter    iterator
+ */
+static void eval_iter_start(eval_iter_t *iter)
+{
+    ifstack_reset();
+    switches_count   = 0;
+    iter->lines      = 0;
+    iter->lines_live = 0;
+    iter->directives = 0;
+    iter->max_depth  = 0;
+    iter->error      = EVAL_OK;
+}
+
+
+/** \brief  Open file for evaluation
+ *
+ * Resets the if-stack and the counters of \a iter.
+ *
+ * \param[in,out]   iter        iterator
+ * \param[in]       path        path to file, "-" for standard input
+ * \param[in]       check_utf8  validate input as UTF-8
+ *
+ * \return  \c false if the file couldn't be opened, with \c errno set
+ */
+bool eval_iter_open(eval_iter_t *iter, const char *path, bool check_utf8)
+{
+    if (!reader_open(&iter->reader, path, check_utf8)) {
+        return false;
+    }
+    eval_iter_start(iter);
+    return true;
+}
+
+
+/** \brief  Open part of an open file for evaluation
+ *
+ * Evaluates the next \a size bytes of \a fd, see reader_open_fd().
+ *
+ * \param[in,out]   iter        iterator
+ * \param[in]       fd          file descriptor
+ * \param[in]       size        number of bytes to evaluate
+ * \param[in]       check_utf8  validate input as UTF-8
+ */
+void eval_iter_open_fd(eval_iter_t *iter, int fd, uint64_t size, bool check_utf8)
+{
+    reader_open_fd(&iter->reader, fd, size, check_utf8);
+    eval_iter_start(iter);
+}
+
+
+/** \brief  Close file
+ *
+ * Memory allocated by the iterator is kept for the next file. Conditions
+ * left open are closed in the profile.
+ *
+ * \param[in,out]   iter    iterator
+ */
+void eval_iter_close(eval_iter_t *iter)
+{
+    reader_close(&iter->reader);
+    if (iter->profile) {
+        profile_end_file();
+    }
+}
+
+
+/** \brief  Free memory used by iterator
+ *
+ * Also frees the if-stack.
+ *
+ * \param[in,out]   iter    iterator
+ */
+void eval_iter_free(eval_iter_t *iter)
+{
+    reader_free(&iter->reader);
+    ifstack_free();
+    for (unsigned int i = 0; i < switches_size; i++) {
+        free(switches[i].value);
+    }
+    free(switches);
+    switches       = NULL;
+    switches_size  = 0;
+    switches_count = 0;
+}
+
+
+/** \brief  Evaluate next line
+ *
+ * A line with an error is returned with its \a el->status set, after which
+ * evaluation ends. Read errors are reported in \a iter->reader.error.
+ *
+ * \param[in,out]   iter    iterator
+ * \param[out]      el      evaluated line
+ *
+ * \return  \c false at the end of the file or after an error
+ */
+bool eval_next_line(eval_iter_t *iter, eval_line_t *el)
+{
+    char   *text;
+    size_t  len;
+
+    if (iter->error != EVAL_OK) {
+        return false;
+    }
+    text = reader_getline(&iter->reader, &len);
+    if (text == NULL) {
+        return false;
+    }
+    iter->lines++;
+
+    line       = text;
+    el->text   = text;
+    el->len    = len;
+    el->offset = iter->reader.offset + (uint64_t)(text - iter->reader.buffer);
+    el->lineno = iter->lines;
+    el->status = handle_line(&el->kind);
+    el->live   = el->kind == EVAL_TEXT && ifstack_true();
+    if (iter->profile && el->status == EVAL_OK) {
+        profile_line(el);
+    }
+
+    if (el->kind != EVAL_TEXT) {
+        iter->directives++;
+    } else if (el->live) {
+        iter->lines_live++;
+    }
+    if (ifstack_depth() > iter->max_depth) {
+        iter->max_depth = ifstack_depth();
+    }
+    iter->error = el->status;
+    return true;
+}
+
+
+/** \brief  Get next span of live text
+ *
+ * Evaluates lines until a live line of text is found, so a consumer that stops
+ * asking for spans stops reading the file.
+ *
+ * \param[in,out]   iter    iterator
+ * \param[out]      span    span of live text
+ *
+ * \return  \c false at the end of the file or on error, see \a iter->error
+ *          and \a iter->reader.error
+ */
+bool eval_next_span(eval_iter_t *iter, eval_span_t *span)
+{
+    eval_line_t el;
+
+    while (eval_next_line(iter, &el)) {
+        if (el.live) {
+            span->text   = el.text;
+            span->len    = el.len;
+            span->offset = el.offset;
+            span->lineno = el.lineno;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** \brief  Get message for evaluation status
+ *
+ * For \c EVAL_ERR_STACK the stack's message is in \c ifstack_errno.
+ *
+ * \param[in]   status  evaluation status (\c EVAL_OK etc)
+ *
+ * \return  message
+ */
+const char *eval_strerror(int status)
+{
+    if (status < 0 || status >= (int)(sizeof status_messages / sizeof status_messages[0])) {
+        return "invalid status";
+    }
+    return status_messages[status];
+}
@@ -0,0 +1,100 @@
+/** \file   eval.h
+ * \brief   Line evaluator - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef EVAL_H
+#define EVAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "reader.h"
+
+/** \brief  Kinds of line
+ */
+enum {
+    EVAL_TEXT,
+    EVAL_IF,
+    EVAL_ELSE,
+    EVAL_ENDIF,
+    EVAL_SWITCH,
+    EVAL_CASE,
+    EVAL_DEFAULT,
+    EVAL_ENDSWITCH
+};
+
+/** \brief  Evaluation status
+ */
+enum {
+    EVAL_OK,
+    EVAL_ERR_ARGUMENT,  /**< directive without required argument */
+    EVAL_ERR_STACK      /**< directive invalid on the stack, see \c ifstack_errno */
+};
+
+/** \brief  Evaluated line
+ */
+typedef struct eval_line_s {
+    const char *text;   /**< text of the line */
+    size_t      len;    /**< length of \c text */
+    uint64_t    offset; /**< offset of \c text in the file */
+    uint64_t    lineno; /**< line number */
+    int         kind;   /**< kind of line (\c EVAL_TEXT etc) */
+    int         status; /**< evaluation status (\c EVAL_OK etc) */
+    bool        live;   /**< line is text and the stack's condition is true */
+} eval_line_t;
+
+/** \brief  Span of live text
+ */
+typedef struct eval_span_s {
+    const char *text;   /**< text of the span */
+    size_t      len;    /**< length of \c text */
+    uint64_t    offset; /**< offset of \c text in the file */
+    uint64_t    lineno; /**< line number of the start of the span */
+} eval_span_t;
+
+/** \brief  Evaluation iterator
+ *
+ * Pulls lines from a file and evaluates them on demand, so consumers that
+ * stop early don't read the rest of the file.
+ */
+typedef struct eval_iter_s {
+    reader_t      reader;       /**< line reader */
+    uint64_t      lines;        /**< number of lines read */
+    uint64_t      lines_live;   /**< number of live text lines */
+    uint64_t      directives;   /**< number of directives */
+    unsigned int  max_depth;    /**< maximum stack depth */
+    int           error;        /**< status of the line that ended evaluation */
+    bool          profile;      /**< update the profile, see profile.h */
+} eval_iter_t;
+
+void eval_iter_init(eval_iter_t *iter);
+bool eval_iter_open(eval_iter_t *iter, const char *path, bool check_utf8);
+void eval_iter_open_fd(eval_iter_t *iter, int fd, uint64_t size, bool check_utf8);
+void eval_iter_close(eval_iter_t *iter);
+void eval_iter_free(eval_iter_t *iter);
+bool eval_next_line(eval_iter_t *iter, eval_line_t *el);
+bool eval_next_span(eval_iter_t *iter, eval_span_t *span);
+
+const char *eval_strerror(int status);
+
+#endif
@@ -0,0 +1,126 @@
+/** \file   hist.c
+ * \brief   Log-bucketed histograms
+ *
+ * Fixed-size histograms in the style of HdrHistogram: values are bucketed by
+ * their most significant bits, so recording is O(1) and percentiles are
+ * accurate to within 1 / 2^HIST_SUB_BITS over the full 64-bit range.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdint.h>
+
+#include "hist.h"
+
+
+/** \brief  Number of sub-buckets per power of two */
+#define SUB_BUCKETS (1u << HIST_SUB_BITS)
+
+
+/** \brief  Get bucket index of value
+ *
+ * Values below \c SUB_BUCKETS get their own bucket, larger values are bucketed
+ * by the position of their highest set bit and the \c HIST_SUB_BITS bits
+ * below it.
+ *
+ * \param[in]   value   value
+ *
+ * \return  bucket index
+ */
+static unsigned int bucket_index(uint64_t value)
+{
+    unsigned int msb = 0;
+
+    if (value < SUB_BUCKETS) {
+        return (unsigned int)value;
+    }
+    for (uint64_t v = value; v > 1; v >>= 1) {
+        msb++;
+    }
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+           (unsigned int)((value >> (msb - HIST_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/** \brief  Get highest value of bucket
+ *
+ * \param[in]   index   bucket index
+ *
+ * \return  highest value that maps to bucket \a index
+ */
+static uint64_t bucket_max(unsigned int index)
+{
+    unsigned int shift;
+    uint64_t     low;
+
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    shift = (index >> HIST_SUB_BITS) - 1;
+    low   = (uint64_t)(SUB_BUCKETS | (index & (SUB_BUCKETS - 1))) << shift;
+    return low + (((uint64_t)1 << shift) - 1);
+}
+
+
+/** \brief  Record value in histogram
+ *
+ * \param[in,out]   hist    histogram
+ * \param[in]       value   value
+ */
+void hist_record(hist_t *hist, uint64_t value)
+{
+    hist->counts[bucket_index(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+
+/** \brief  Get percentile of recorded values
+ *
+ * \param[in]   hist        histogram
+ * \param[in]   percentile  percentile (0.0 - 100.0)
+ *
+ * \return  value at \a percentile, rounded up to the end of its bucket but
+ *          never more than the maximum recorded value
+ */
+uint64_t hist_percentile(const hist_t *hist, double percentile)
+{
+    uint64_t target;
+    uint64_t seen = 0;
+
+    if (hist->count == 0) {
+        return 0;
+    }
+    target = (uint64_t)((double)hist->count * percentile / 100.0 + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            uint64_t value = bucket_max(i);
+
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
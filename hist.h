@@ -0,0 +1,52 @@
+/** \file   hist.h
+ * \brief   Log-bucketed histograms - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+/** \brief  Number of bits of sub-bucket precision
+ *
+ * Each power of two is split into 2^HIST_SUB_BITS buckets, giving a maximum
+ * relative error of 1 / 2^HIST_SUB_BITS.
+ */
+#define HIST_SUB_BITS   3
+
+/** \brief  Number of buckets in a histogram
+ */
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/** \brief  Histogram of 64-bit values
+ */
+typedef struct hist_s {
+    uint64_t counts[HIST_BUCKETS];  /**< number of values per bucket */
+    uint64_t count;                 /**< number of values recorded */
+    uint64_t sum;                   /**< sum of values recorded */
+    uint64_t max;                   /**< maximum value recorded */
+} hist_t;
+
+void     hist_record(hist_t *hist, uint64_t value);
+uint64_t hist_percentile(const hist_t *hist, double percentile);
+
+#endif
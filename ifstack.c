@@ -1,6 +1,9 @@
 /** \file   ifstack.c
  * \brief   IF stack implementation
  *
+ * The stack is per thread when compiled as C11, so each thread can evaluate
+ * its own input.
+ *
  * \author  Bas Wassink <b.wassink@ziggo.nl>
  */
 
@@ -24,122 +27,291 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "ifstack.h"
 
 
-/** \brief  Doubly linked list node making up the IF stack
+/** \brief  Print debugging information on stderr
+ *
+ * Only enabled when compiled with \c IFSTACK_DEBUG defined, printing on every
+ * ELSE and ENDIF is far too slow for normal use.
+ */
+#ifdef IFSTACK_DEBUG
+# define debug_printf(...)  fprintf(stderr, __VA_ARGS__)
+#else
+# define debug_printf(...)
+#endif
+
+
+/** \brief  Initial number of words allocated for the stack */
+#define IFSTACK_INITIAL_SIZE    4
+
+/** \brief  Number of bits used per stack level */
+#define LEVEL_BITS      4
+
+/** \brief  Number of stack levels per word */
+#define LEVELS_PER_WORD (64 / LEVEL_BITS)
+
+/** \brief  Mask for a single level */
+#define LEVEL_MASK      ((uint64_t)((1 << LEVEL_BITS) - 1))
+
+/** \brief  Mask for the local condition of a level state */
+#define LEVEL_TRUE      1
+
+
+/** \brief  Stack level states
+ *
+ * Each level of the stack is a 4-bit state, bit 0 is the local condition of
+ * the branch.
+ */
+enum {
+    LEVEL_IF_FALSE      = 0,    /**< IF branch, not taken */
+    LEVEL_IF_TRUE       = 1,    /**< IF branch, taken */
+    LEVEL_ELSE_FALSE    = 2,    /**< ELSE branch, not taken (IF was taken) */
+    LEVEL_ELSE_TRUE     = 3,    /**< ELSE branch, taken */
+    LEVEL_SWITCH_SEARCH = 4,    /**< SWITCH, no CASE matched yet */
+    LEVEL_CASE_TRUE     = 5,    /**< matching CASE, taken */
+    LEVEL_SWITCH_DONE   = 6,    /**< SWITCH, CASE matched before */
+    LEVEL_DEFAULT_TRUE  = 7,    /**< DEFAULT, taken (no CASE matched) */
+    LEVEL_DEFAULT_FALSE = 8,    /**< DEFAULT, not taken (CASE matched) */
+
+    LEVEL_POP           = 15    /**< level is pulled off the stack */
+};
+
+/** \brief  Events changing the state of the top level of the stack
+ */
+enum {
+    EVENT_ELSE,         /**< ELSE */
+    EVENT_CASE,         /**< CASE not matching the SWITCH value */
+    EVENT_CASE_MATCH,   /**< CASE matching the SWITCH value */
+    EVENT_DEFAULT,      /**< DEFAULT */
+    EVENT_ENDIF,        /**< ENDIF */
+    EVENT_ENDSWITCH,    /**< ENDSWITCH */
+
+    EVENT_COUNT
+};
+
+/* shorthands for the transition table */
+#define E_ELSE      (-IFSTACK_ERR_ELSE_WITHOUT_IF)
+#define E_ENDIF     (-IFSTACK_ERR_ENDIF_WITHOUT_IF)
+#define E_CASE      (-IFSTACK_ERR_CASE_WITHOUT_SWITCH)
+#define E_CASE_DEF  (-IFSTACK_ERR_CASE_AFTER_DEFAULT)
+#define E_DEFAULT   (-IFSTACK_ERR_DEFAULT_WITHOUT_SWITCH)
+#define E_DUP_DEF   (-IFSTACK_ERR_DUPLICATE_DEFAULT)
+#define E_ENDSWITCH (-IFSTACK_ERR_ENDSWITCH_WITHOUT_SWITCH)
+
+/** \brief  State transitions of the top level of the stack
+ *
+ * Indexed by event and current state, negative values are the negated error
+ * code for an invalid event in that state.
  */
-typedef struct ifstack_s {
-    bool              state;    /**< branch IF state */
-    bool              in_else;  /**< currently in local ELSE branch */
-    struct ifstack_s *up;       /**< next node (up in stack) */
-    struct ifstack_s *down;     /**< previous node (down in stack) */
-} ifstack_t;
+static const int8_t transitions[EVENT_COUNT][LEVEL_DEFAULT_FALSE + 1] = {
+    [EVENT_ELSE] = {
+        LEVEL_ELSE_TRUE, LEVEL_ELSE_FALSE, E_ELSE, E_ELSE,
+        E_ELSE, E_ELSE, E_ELSE, E_ELSE, E_ELSE
+    },
+    [EVENT_CASE] = {
+        E_CASE, E_CASE, E_CASE, E_CASE,
+        LEVEL_SWITCH_SEARCH, LEVEL_SWITCH_DONE, LEVEL_SWITCH_DONE,
+        E_CASE_DEF, E_CASE_DEF
+    },
+    [EVENT_CASE_MATCH] = {
+        E_CASE, E_CASE, E_CASE, E_CASE,
+        LEVEL_CASE_TRUE, LEVEL_SWITCH_DONE, LEVEL_SWITCH_DONE,
+        E_CASE_DEF, E_CASE_DEF
+    },
+    [EVENT_DEFAULT] = {
+        E_DEFAULT, E_DEFAULT, E_DEFAULT, E_DEFAULT,
+        LEVEL_DEFAULT_TRUE, LEVEL_DEFAULT_FALSE, LEVEL_DEFAULT_FALSE,
+        E_DUP_DEF, E_DUP_DEF
+    },
+    [EVENT_ENDIF] = {
+        LEVEL_POP, LEVEL_POP, LEVEL_POP, LEVEL_POP,
+        E_ENDIF, E_ENDIF, E_ENDIF, E_ENDIF, E_ENDIF
+    },
+    [EVENT_ENDSWITCH] = {
+        E_ENDSWITCH, E_ENDSWITCH, E_ENDSWITCH, E_ENDSWITCH,
+        LEVEL_POP, LEVEL_POP, LEVEL_POP, LEVEL_POP, LEVEL_POP
+    }
+};
 
+/** \brief  Error codes for events on an empty stack
+ */
+static const int empty_errors[EVENT_COUNT] = {
+    [EVENT_ELSE]        = IFSTACK_ERR_ELSE_WITHOUT_IF,
+    [EVENT_CASE]        = IFSTACK_ERR_CASE_WITHOUT_SWITCH,
+    [EVENT_CASE_MATCH]  = IFSTACK_ERR_CASE_WITHOUT_SWITCH,
+    [EVENT_DEFAULT]     = IFSTACK_ERR_DEFAULT_WITHOUT_SWITCH,
+    [EVENT_ENDIF]       = IFSTACK_ERR_ENDIF_WITHOUT_IF,
+    [EVENT_ENDSWITCH]   = IFSTACK_ERR_ENDSWITCH_WITHOUT_SWITCH
+};
 
 /** \brief  Error message strings */
 static const char *err_messages[] = {
     "OK",
     "else without if",
-    "endif without if"
+    "endif without if",
+    "case without switch",
+    "case after default",
+    "default without switch",
+    "duplicate default",
+    "endswitch without switch"
 };
 
-/** \brief  IF stack reference
+/** \brief  IF stack storage
  *
- * This references the top of the stack.
+ * Levels packed \c LEVELS_PER_WORD to a word, level 0 (the bottom of the
+ * stack) in the lowest bits of \c levels[0]. The array is kept when resetting
+ * the stack, so reusing the stack doesn't allocate memory once it has grown
+ * large enough.
+ */
+static IFSTACK_THREAD_LOCAL uint64_t *levels;
+
+/** \brief  Number of words allocated in \c levels
+ */
+static IFSTACK_THREAD_LOCAL unsigned int levels_size;
+
+/** \brief  Number of levels on the stack
  */
-static ifstack_t *stack;
+static IFSTACK_THREAD_LOCAL unsigned int depth;
 
-/** \brief  IF stack bottom reference
+/** \brief  Number of levels on the stack whose local condition is false
  *
- * Used for printing the stack from bottom to top in ifstack_print().
+ * The global condition is true when no level is false, which makes it
+ * independent of the stack depth and needs no branches to update.
+ */
+static IFSTACK_THREAD_LOCAL unsigned int false_levels;
+
+
+/** \brief  Error code of the calling thread's stack
  */
-static ifstack_t *stack_bottom;
+IFSTACK_THREAD_LOCAL int ifstack_errno = 0;
 
-/** \brief  Global "truth" state
+
+/** \brief  Get state of stack level
+ *
+ * \param[in]   level   stack level
+ *
+ * \return  state (\c LEVEL_*)
  */
-static bool       current_state;
+static unsigned int level_get(unsigned int level)
+{
+    unsigned int shift = (level % LEVELS_PER_WORD) * LEVEL_BITS;
 
+    return (unsigned int)((levels[level / LEVELS_PER_WORD] >> shift) & LEVEL_MASK);
+}
 
-/** \brief  Error code
+/** \brief  Set state of stack level
+ *
+ * \param[in]   level   stack level
+ * \param[in]   state   state (\c LEVEL_*)
  */
-int ifstack_errno = 0;
+static void level_set(unsigned int level, unsigned int state)
+{
+    unsigned int  shift = (level % LEVELS_PER_WORD) * LEVEL_BITS;
+    uint64_t     *word  = &levels[level / LEVELS_PER_WORD];
 
+    *word = (*word & ~(LEVEL_MASK << shift)) | ((uint64_t)state << shift);
+}
 
-/** \brief  Push new condition onto the stack
+/** \brief  Push new level onto the stack
  *
- * Register an \c IF with condition \a state.
+ * \param[in]   state   state of the new level (\c LEVEL_*)
  *
  * \note    Calls \c exit(1) on out-of-memory.
  */
-static void ifstack_push(bool state)
+static void ifstack_push(unsigned int state)
 {
-    ifstack_t *node = malloc(sizeof *node);
-
-    if (node == NULL) {
-        fprintf(stderr,
-                "%s(): failed to allocate %zu bytes, exiting.\n",
-                __func__, sizeof *node);
-        exit(1);
+    if (depth == levels_size * LEVELS_PER_WORD) {
+        unsigned int  size = levels_size > 0 ? levels_size * 2 : IFSTACK_INITIAL_SIZE;
+        uint64_t     *tmp  = realloc(levels, size * sizeof *levels);
+
+        if (tmp == NULL) {
+            fprintf(stderr,
+                    "%s(): failed to allocate %zu bytes, exiting.\n",
+                    __func__, size * sizeof *levels);
+            exit(1);
+        }
+        levels      = tmp;
+        levels_size = size;
     }
 
-    node->state   = state;
-    node->in_else = false;
-    node->up      = NULL;
-    node->down    = stack;
-    if (stack != NULL) {
-        stack->up = node;
-    } else {
-        stack_bottom = node;
-    }
-    stack = node;
+    level_set(depth++, state);
+    false_levels += !(state & LEVEL_TRUE);
 }
 
-/** \brief  Pull current condtion off the stack
+/** \brief  Pull current level off the stack
  */
 static void ifstack_pull(void)
 {
-    if (stack == NULL) {
+    if (depth == 0) {
         fprintf(stderr, "%s(): error: stack empty!\n", __func__);
         exit(1);
-    } else {
-        ifstack_t *down = stack->down;
-
-        free(stack);
-        stack = down;
-        if (stack == NULL) {
-            /* no previous condition of stack, set current state to true */
-            current_state = true;
-            /* clear stack bottom pointer */
-            stack_bottom = NULL;
-        } else {
-            stack->up = NULL;
-            printf("%s() stack->state = %s\n", __func__, stack->state ? "true" : "false");
-            current_state = stack->state;
-        }
     }
+    false_levels -= !(level_get(--depth) & LEVEL_TRUE);
+    debug_printf("%s(): depth = %u, false levels = %u\n", __func__, depth, false_levels);
+}
+
+/** \brief  Change state of the top level of the stack
+ *
+ * Look up the transition for \a event in the current state of the top level
+ * and apply it, pulling the level off the stack if the transition says so.
+ *
+ * \param[in]   event   event (\c EVENT_*)
+ *
+ * \return  \c false if \a event isn't valid in the current state, with
+ *          \c ifstack_errno set
+ */
+static bool ifstack_event(int event)
+{
+    unsigned int state;
+    int          next;
+
+    if (depth == 0) {
+        ifstack_errno = empty_errors[event];
+        return false;
+    }
+
+    state = level_get(depth - 1);
+    next  = transitions[event][state];
+    if (next < 0) {
+        ifstack_errno = -next;
+        return false;
+    }
+    if (next == LEVEL_POP) {
+        ifstack_pull();
+        return true;
+    }
+
+    level_set(depth - 1, (unsigned int)next);
+    false_levels = false_levels + (state & LEVEL_TRUE) - ((unsigned int)next & LEVEL_TRUE);
+
+    debug_printf("%s(): event %d, level state %u -> %d, false levels = %u\n",
+                 __func__, event, state, next, false_levels);
+    return true;
 }
 
 
 /** \brief  Initialize stack for use
+ *
+ * Memory already allocated for the stack is kept.
  */
 void ifstack_init(void)
 {
-    stack         = NULL;
-    stack_bottom  = NULL;
+    depth         = 0;
+    false_levels  = 0;
     ifstack_errno = 0;
-    current_state = true;
 }
 
 
 /** \brief  Reset stack for reuse
  *
- * Frees any old stack remaining and initializes the stack for reuse.
+ * Clears the stack for reuse, keeping the memory allocated for it so
+ * parsing another file doesn't require allocating memory again.
  */
 void ifstack_reset(void)
 {
-    ifstack_free();
     ifstack_init();
 }
 
@@ -148,16 +320,11 @@ void ifstack_reset(void)
  */
 void ifstack_free(void)
 {
-    ifstack_t *node = stack;
-
-    while (node != NULL) {
-        ifstack_t *down = node->down;
-
-        free(node);
-        node = down;
-    }
-    stack        = NULL;
-    stack_bottom = NULL;
+    free(levels);
+    levels       = NULL;
+    levels_size  = 0;
+    depth        = 0;
+    false_levels = 0;
 }
 
 
@@ -169,11 +336,23 @@ void ifstack_free(void)
  */
 void ifstack_print(void)
 {
-    putchar('[');
-    for (ifstack_t *node = stack_bottom; node != NULL; node = node->up) {
-        putchar(node->state ? '1' : '0');
+    ifstack_fprint(stdout);
+}
+
+
+/** \brief  Print stack contents on a stream
+ *
+ * \param[in]   fp  stream
+ *
+ * \see     ifstack_print()
+ */
+void ifstack_fprint(FILE *fp)
+{
+    putc('[', fp);
+    for (unsigned int i = 0; i < depth; i++) {
+        putc('0' + (int)(level_get(i) & LEVEL_TRUE), fp);
     }
-    putchar(']');
+    putc(']', fp);
 }
 
 
@@ -183,7 +362,17 @@ void ifstack_print(void)
  */
 bool ifstack_true(void)
 {
-    return current_state;
+    return false_levels == 0;
+}
+
+
+/** \brief  Get current depth of stack
+ *
+ * \return  number of unclosed IF and SWITCH statements
+ */
+unsigned int ifstack_depth(void)
+{
+    return depth;
 }
 
 
@@ -193,10 +382,7 @@ bool ifstack_true(void)
  */
 void ifstack_if(bool state)
 {
-    ifstack_push(state);
-    if (stack->down == NULL || (stack->down != NULL && stack->down->state)) {
-        current_state = state;
-    }
+    ifstack_push(state ? LEVEL_IF_TRUE : LEVEL_IF_FALSE);
 }
 
 
@@ -208,73 +394,76 @@ void ifstack_if(bool state)
  */
 bool ifstack_else(void)
 {
-    if (stack == NULL || stack->in_else) {
-        ifstack_errno = IFSTACK_ERR_ELSE_WITHOUT_IF;
-        return false;
-    }
+    return ifstack_event(EVENT_ELSE);
+}
 
-    printf("%s(): stack->state = %s, global = %s ... inverting stack->state\n",
-           __func__, stack->state ? "true" : "false", current_state ? "true" : "false");
 
-    stack->in_else = true;
-    stack->state  = !stack->state;
+/** \brief  Process ENDIF
+ *
+ * Notify the stack an ENDIF statement should be handled.
+ *
+ * \return  \c false if there's no preceeding IF/ELSE
+ */
+bool ifstack_endif(void)
+{
+    return ifstack_event(EVENT_ENDIF);
+}
 
-    /* only invert global state if it's true */
-    if (current_state) {
-        /* invert global state */
-        printf("%s(): current state is true, setting to false\n", __func__);
-        current_state = false;
-    } else {
-        printf("%s(): current state is false...\n", __func__);
-
-        if (stack->down != NULL) {
-            if (stack->down->state) {
-                printf("%s(): previous condition present and true, setting current state to true\n",
-                    __func__);
-                /* invert state */
-                current_state = true;
-            } else {
-                printf("%s(): previous condition present and false ... ignore\n", __func__);
-                /* do nothing */
-            }
-        } else {
-            printf("%s(): no previous condition, set condition to true\n", __func__);
-            /* invert state */
-            current_state = true;
-        }
-    }
 
-#if 0
-    /* if previous condition present AND false: DON'T invert global condition */
-    if (!(stack->down != NULL && !(stack->down->state))) {
-        current_state = !current_state;
-    } else if (stack->down == NULL) {
-        current_state = !current_state;
-    }
-#endif
-    printf("%s(): stack->state = %s, global = %s\n",
-           __func__, stack->state ? "true" : "false", current_state ? "true" : "false");
+/** \brief  Push new SWITCH on stack
+ *
+ * The SWITCH's level is false until a matching CASE or a DEFAULT is found.
+ */
+void ifstack_switch(void)
+{
+    ifstack_push(LEVEL_SWITCH_SEARCH);
+}
 
-    return true;
+
+/** \brief  Process CASE
+ *
+ * The CASE is taken if it matches the SWITCH's value and no earlier CASE of the
+ * SWITCH matched.
+ *
+ * \param[in]   match   CASE value matches the SWITCH's value
+ *
+ * \return  \c false if not in a SWITCH or already in the DEFAULT branch
+ */
+bool ifstack_case(bool match)
+{
+    return ifstack_event(match ? EVENT_CASE_MATCH : EVENT_CASE);
 }
 
 
-/** \brief  Process ENDIF
+/** \brief  Process DEFAULT
  *
- * Notify the stack an ENDIF statement should be handled.
+ * The DEFAULT branch is taken if no CASE of the SWITCH matched.
  *
- * \return  \c false if there's no preceeding IF/ELSE
+ * \return  \c false if not in a SWITCH or already in the DEFAULT branch
  */
-bool ifstack_endif(void)
+bool ifstack_default(void)
 {
-    if (stack == NULL) {
-        ifstack_errno = IFSTACK_ERR_ENDIF_WITHOUT_IF;
-        return false;
-    }
+    return ifstack_event(EVENT_DEFAULT);
+}
 
-    /* pull condition off the stack */
-    ifstack_pull();
-    return true;
+
+/** \brief  Process ENDSWITCH
+ *
+ * \return  \c false if there's no preceeding SWITCH
+ */
+bool ifstack_endswitch(void)
+{
+    return ifstack_event(EVENT_ENDSWITCH);
+}
+
+
+/** \brief  Get condition of the innermost IF or SWITCH
+ *
+ * \return  condition of the top level of the stack, \c true for an empty stack
+ */
+bool ifstack_top(void)
+{
+    return depth == 0 || (level_get(depth - 1) & LEVEL_TRUE);
 }
 
 
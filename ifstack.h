@@ -24,25 +24,51 @@
 #ifndef IFSTACK_H
 #define IFSTACK_H
 
+#include <stdio.h>
 #include <stdbool.h>
 
+/** \brief  Storage class of the stack's state
+ *
+ * With C11 each thread has its own stack, C99 has a single stack shared by
+ * all threads, which \c IFSTACK_PER_THREAD tells callers.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+# define IFSTACK_THREAD_LOCAL   _Thread_local
+# define IFSTACK_PER_THREAD     1
+#else
+# define IFSTACK_THREAD_LOCAL
+# define IFSTACK_PER_THREAD     0
+#endif
+
 enum {
     IFSTACK_ERR_OK,
     IFSTACK_ERR_ELSE_WITHOUT_IF,
-    IFSTACK_ERR_ENDIF_WITHOUT_IF
+    IFSTACK_ERR_ENDIF_WITHOUT_IF,
+    IFSTACK_ERR_CASE_WITHOUT_SWITCH,
+    IFSTACK_ERR_CASE_AFTER_DEFAULT,
+    IFSTACK_ERR_DEFAULT_WITHOUT_SWITCH,
+    IFSTACK_ERR_DUPLICATE_DEFAULT,
+    IFSTACK_ERR_ENDSWITCH_WITHOUT_SWITCH
 };
 
-extern int ifstack_errno;
+extern IFSTACK_THREAD_LOCAL int ifstack_errno;
 
 void ifstack_init(void);
 void ifstack_reset(void);
 void ifstack_free(void);
 void ifstack_print(void);
+void ifstack_fprint(FILE *fp);
 
 void ifstack_if(bool state);
 bool ifstack_else(void);
 bool ifstack_endif(void);
+void ifstack_switch(void);
+bool ifstack_case(bool match);
+bool ifstack_default(void);
+bool ifstack_endswitch(void);
 bool ifstack_true(void);
+bool ifstack_top(void);
+unsigned int ifstack_depth(void);
 
 const char *ifstack_strerror(int errnum);
 
@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# journal-test.sh - test resuming a journaled run
+#
+# Runs stack-test with --journal and --output over files with an erroring
+# file in the middle, interrupts the run after the erroring file by cutting
+# the journal and the output short, and checks that resuming produces the
+# same output and exit status as the uninterrupted run.
+#
+# usage: ./journal-test.sh [<path to stack-test>]
+
+prog=$(cd "$(dirname "${1:-./stack-test}")" && pwd)/$(basename "${1:-./stack-test}")
+src=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+cd "$tmp" || exit 1
+cp "$src/simple-test.txt" a.txt
+cp "$src/else-without-if.txt" b.txt
+cp "$src/nested-if.txt" c.txt
+printf 'valid\n\377 invalid\n' > u.txt
+
+# check <name> <options> <files>
+check()
+{
+    name=$1
+    options=$2
+    shift 2
+
+    rm -f ref.txt ref.jnl out.txt out.jnl
+    "$prog" $options --journal ref.jnl --output ref.txt "$@" 2>/dev/null
+    expected=$?
+
+    # full journal: everything is skipped
+    cp ref.jnl out.jnl
+    cp ref.txt out.txt
+    "$prog" $options --journal out.jnl --output out.txt "$@" 2>/dev/null
+    status=$?
+    if ! cmp -s ref.txt out.txt || [ $status -ne $expected ]; then
+        echo "FAIL: $name: resume after a complete run"
+        failed=1
+    fi
+
+    # interrupted after the second file, with part of the third's output
+    head -n 2 ref.jnl > out.jnl
+    end=$(sed -n '2s/^[^ ]* [^ ]* [^ ]* \([0-9]*\) .*/\1/p' ref.jnl)
+    head -c $((end + 10)) ref.txt > out.txt
+    "$prog" $options --journal out.jnl --output out.txt "$@" 2>/dev/null
+    status=$?
+    if ! cmp -s ref.txt out.txt || [ $status -ne $expected ]; then
+        echo "FAIL: $name: resume after an interrupted run"
+        failed=1
+    fi
+}
+
+check "evaluation error" "" a.txt b.txt c.txt
+check "evaluation error, filter" "--filter" a.txt b.txt c.txt
+check "evaluation error, workers" "--workers 2" a.txt b.txt c.txt
+check "invalid UTF-8" "--utf8" a.txt u.txt c.txt
+check "invalid UTF-8, workers" "--utf8 --workers 2" a.txt u.txt c.txt
+
+[ $failed -eq 0 ] && echo "journal-test: all passed"
+exit $failed
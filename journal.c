@@ -0,0 +1,480 @@
+/** \file   journal.c
+ * \brief   Completion journal
+ *
+ * Records the files completed by a batch run, so a restarted run can skip
+ * them. Each completed file is appended to the journal as a line:
+ *
+ * <tt>\<content hash\> \<config hash\> \<output hash\> \<output end\> \<status\> \<path\></tt>
+ *
+ * The hashes are 64-bit FNV-1a hashes in hexadecimal, the output end is the
+ * offset in the output file after the file's output, in decimal. The status
+ * is the caller's error status of the file, in decimal, 0 for a file
+ * completed without errors. Entries are
+ * collected in memory and written to the journal in batches, after syncing
+ * the output, so an entry in the journal means the file's output is on disk.
+ * An incomplete last line, left by a crash while writing it, is ignored and
+ * removed when reopening the journal.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+
+/** \brief  Sync the journal after this many entries */
+#define JOURNAL_SYNC_ENTRIES    64
+
+/** \brief  Sync the journal when this many seconds passed since the last sync */
+#define JOURNAL_SYNC_SECONDS    1
+
+/** \brief  Size of the read buffer for hashing files */
+#define JOURNAL_READ_SIZE       65536
+
+
+/** \brief  Journal file descriptor, -1 when not open */
+static int journal_fd = -1;
+
+/** \brief  Lines of the entries added since the last sync */
+static char *pending;
+
+/** \brief  Number of bytes allocated in \c pending */
+static size_t pending_size;
+
+/** \brief  Number of bytes in \c pending */
+static size_t pending_len;
+
+/** \brief  Journal entries, in order */
+static journal_entry_t *entries;
+
+/** \brief  Number of entries allocated in \c entries */
+static size_t entries_size;
+
+/** \brief  Number of entries in \c entries */
+static size_t entries_count;
+
+/** \brief  Hash index of \c entries by path, entry index + 1, 0 for empty */
+static size_t *index_slots;
+
+/** \brief  Number of slots in \c index_slots, a power of 2 */
+static size_t index_size;
+
+/** \brief  Number of entries added since the last sync */
+static unsigned int unsynced;
+
+/** \brief  Time of the last sync */
+static time_t synced_at;
+
+
+/** \brief  Find index slot for path
+ *
+ * \param[in]   path    path
+ *
+ * \return  slot containing the entry for \a path, or the empty slot where it
+ *          belongs
+ */
+static size_t *index_find(const char *path)
+{
+    size_t mask = index_size - 1;
+    size_t i    = (size_t)journal_hash(JOURNAL_HASH_INIT, path, strlen(path)) & mask;
+
+    while (index_slots[i] != 0 && strcmp(entries[index_slots[i] - 1].path, path) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &index_slots[i];
+}
+
+/** \brief  Rebuild hash index with twice the number of slots
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void index_grow(void)
+{
+    size_t size = index_size > 0 ? index_size * 2 : 1024;
+
+    free(index_slots);
+    index_slots = calloc(size, sizeof *index_slots);
+    if (index_slots == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, size * sizeof *index_slots);
+        exit(1);
+    }
+    index_size = size;
+    for (size_t i = 0; i < entries_count; i++) {
+        *index_find(entries[i].path) = i + 1;
+    }
+}
+
+/** \brief  Add entry to memory
+ *
+ * A later entry for the same path replaces the earlier one in the index.
+ *
+ * \param[in]   entry   entry, its path is ignored
+ * \param[in]   path    path to input file
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void entry_add(const journal_entry_t *entry, const char *path)
+{
+    journal_entry_t *e;
+
+    if (entries_count == entries_size) {
+        size_t           size = entries_size > 0 ? entries_size * 2 : 256;
+        journal_entry_t *tmp  = realloc(entries, size * sizeof *entries);
+
+        if (tmp == NULL) {
+            fprintf(stderr,
+                    "%s(): failed to allocate %zu bytes, exiting.\n",
+                    __func__, size * sizeof *entries);
+            exit(1);
+        }
+        entries      = tmp;
+        entries_size = size;
+    }
+
+    e       = &entries[entries_count++];
+    *e      = *entry;
+    e->path = strdup(path);
+    if (e->path == NULL) {
+        fprintf(stderr, "%s(): failed to allocate memory, exiting.\n", __func__);
+        exit(1);
+    }
+
+    if (entries_count * 2 > index_size) {
+        index_grow();
+    } else {
+        *index_find(e->path) = entries_count;
+    }
+}
+
+/** \brief  Append line to the pending entries
+ *
+ * \param[in]   line    line
+ * \param[in]   len     length of \a line
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void pending_add(const char *line, size_t len)
+{
+    if (pending_len + len > pending_size) {
+        size_t  size = pending_size > 0 ? pending_size * 2 : 4096;
+        char   *tmp;
+
+        while (size < pending_len + len) {
+            size *= 2;
+        }
+        tmp = realloc(pending, size);
+        if (tmp == NULL) {
+            fprintf(stderr,
+                    "%s(): failed to allocate %zu bytes, exiting.\n",
+                    __func__, size);
+            exit(1);
+        }
+        pending      = tmp;
+        pending_size = size;
+    }
+    memcpy(pending + pending_len, line, len);
+    pending_len += len;
+}
+
+/** \brief  Sync output to disk, then write and sync the pending entries
+ *
+ * The output is synced first, so the journal never lists a file whose output
+ * isn't on disk. Syncing fails harmlessly for output to a pipe or terminal.
+ *
+ * \return  \c false on error syncing the output or writing the journal
+ */
+static bool journal_sync(void)
+{
+    size_t done = 0;
+
+    unsynced  = 0;
+    synced_at = time(NULL);
+
+    if (fflush(stdout) != 0
+            || (fsync(STDOUT_FILENO) != 0 && errno != EINVAL && errno != EROFS)) {
+        return false;
+    }
+    while (done < pending_len) {
+        ssize_t n = write(journal_fd, pending + done, pending_len - done);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += (size_t)n;
+    }
+    pending_len = 0;
+    return fsync(journal_fd) == 0;
+}
+
+
+/** \brief  Update hash with data
+ *
+ * 64-bit FNV-1a hash, start with \c JOURNAL_HASH_INIT.
+ *
+ * \param[in]   hash    hash of preceding data
+ * \param[in]   data    data
+ * \param[in]   len     length of \a data
+ *
+ * \return  hash
+ */
+uint64_t journal_hash(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *s = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= s[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/** \brief  Calculate hash of part of a file
+ *
+ * \param[in]   fd      file descriptor
+ * \param[in]   offset  offset of data in file
+ * \param[in]   len     length of data, hashing stops early at end of file
+ * \param[out]  hash    hash of the data
+ *
+ * \return  \c false on error, with \c errno set
+ */
+bool journal_hash_range(int fd, uint64_t offset, uint64_t len, uint64_t *hash)
+{
+    char buffer[JOURNAL_READ_SIZE];
+
+    *hash = JOURNAL_HASH_INIT;
+    while (len > 0) {
+        size_t  size = len < sizeof buffer ? (size_t)len : sizeof buffer;
+        ssize_t n    = pread(fd, buffer, size, (off_t)offset);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        *hash   = journal_hash(*hash, buffer, (size_t)n);
+        offset += (uint64_t)n;
+        len    -= (uint64_t)n;
+    }
+    return true;
+}
+
+
+/** \brief  Calculate hash of file content
+ *
+ * \param[in]   path    path to file
+ * \param[out]  hash    hash of the file's content
+ *
+ * \return  \c false on error, with \c errno set
+ */
+bool journal_hash_file(const char *path, uint64_t *hash)
+{
+    bool ok;
+    int  fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+    ok = journal_hash_range(fd, 0, UINT64_MAX, hash);
+    close(fd);
+    return ok;
+}
+
+
+/** \brief  Open journal
+ *
+ * Reads the entries of an existing journal and opens it for appending, or
+ * creates it.
+ *
+ * \param[in]   path    path to journal
+ *
+ * \return  \c false on error
+ */
+bool journal_open(const char *path)
+{
+    FILE    *fp;
+    char    *line     = NULL;
+    size_t   size     = 0;
+    ssize_t  len;
+    long     complete = 0;
+
+    fp = fopen(path, "r");
+    if (fp != NULL) {
+        while ((len = getline(&line, &size, fp)) > 0) {
+            journal_entry_t entry;
+            int             pos = 0;
+
+            if (line[len - 1] != '\n') {
+                /* incomplete last line */
+                break;
+            }
+            line[len - 1] = '\0';
+            if (sscanf(line, "%16" SCNx64 " %16" SCNx64 " %16" SCNx64 " %" SCNu64 " %u %n",
+                       &entry.content, &entry.config, &entry.output,
+                       &entry.output_end, &entry.status, &pos) == 5
+                    && pos > 0 && line[pos] != '\0') {
+                entry_add(&entry, line + pos);
+            }
+            complete = ftell(fp);
+        }
+        free(line);
+        fclose(fp);
+    } else if (errno != ENOENT) {
+        fprintf(stderr, "error: failed to read journal \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        return false;
+    }
+
+    journal_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (journal_fd < 0 || ftruncate(journal_fd, complete) != 0) {
+        fprintf(stderr, "error: failed to open journal \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        if (journal_fd >= 0) {
+            close(journal_fd);
+            journal_fd = -1;
+        }
+        return false;
+    }
+    unsynced  = 0;
+    synced_at = time(NULL);
+    return true;
+}
+
+
+/** \brief  Find latest entry for path
+ *
+ * \param[in]   path    path to input file
+ *
+ * \return  entry or \c NULL if \a path isn't in the journal
+ */
+const journal_entry_t *journal_find(const char *path)
+{
+    size_t slot;
+
+    if (entries_count == 0) {
+        return NULL;
+    }
+    slot = *index_find(path);
+    return slot > 0 ? &entries[slot - 1] : NULL;
+}
+
+
+/** \brief  Get last entry of the journal
+ *
+ * \return  last entry or \c NULL if the journal is empty
+ */
+const journal_entry_t *journal_last(void)
+{
+    return entries_count > 0 ? &entries[entries_count - 1] : NULL;
+}
+
+
+/** \brief  Add completed file to the journal
+ *
+ * The entry is written to the journal by the next sync, which happens every
+ * \c JOURNAL_SYNC_ENTRIES entries or when \c JOURNAL_SYNC_SECONDS have passed
+ * since the last sync.
+ *
+ * \param[in]   path        path to input file
+ * \param[in]   content     hash of the input file
+ * \param[in]   config      hash of the options affecting the output
+ * \param[in]   output      hash of the output
+ * \param[in]   output_end  offset in output file after the output
+ * \param[in]   status      error status of the file, 0 if none
+ *
+ * \return  \c false on error writing the journal
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+bool journal_add(const char *path, uint64_t content, uint64_t config,
+                 uint64_t output, uint64_t output_end, unsigned int status)
+{
+    journal_entry_t entry;
+    char            line[128];
+    int             len;
+
+    entry.content    = content;
+    entry.config     = config;
+    entry.output     = output;
+    entry.output_end = output_end;
+    entry.status     = status;
+    entry_add(&entry, path);
+
+    len = snprintf(line, sizeof line,
+                   "%016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %" PRIu64 " %u ",
+                   content, config, output, output_end, status);
+    pending_add(line, (size_t)len);
+    pending_add(path, strlen(path));
+    pending_add("\n", 1);
+    if (++unsynced >= JOURNAL_SYNC_ENTRIES || time(NULL) - synced_at >= JOURNAL_SYNC_SECONDS) {
+        return journal_sync();
+    }
+    return true;
+}
+
+
+/** \brief  Sync and close the journal
+ *
+ * \return  \c false on error writing the journal
+ */
+bool journal_close(void)
+{
+    bool ok = true;
+
+    if (journal_fd >= 0) {
+        ok = journal_sync();
+        ok = close(journal_fd) == 0 && ok;
+        journal_fd = -1;
+    }
+    free(pending);
+    pending      = NULL;
+    pending_size = 0;
+    pending_len  = 0;
+    for (size_t i = 0; i < entries_count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+    free(index_slots);
+    entries       = NULL;
+    entries_size  = 0;
+    entries_count = 0;
+    index_slots   = NULL;
+    index_size    = 0;
+    return ok;
+}
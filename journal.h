@@ -0,0 +1,56 @@
+/** \file   journal.h
+ * \brief   Completion journal - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** \brief  Initial value for \c journal_hash() */
+#define JOURNAL_HASH_INIT   14695981039346656037ULL
+
+/** \brief  Journal entry
+ */
+typedef struct journal_entry_s {
+    char         *path;         /**< path to input file */
+    uint64_t      content;      /**< hash of the input file */
+    uint64_t      config;       /**< hash of the options affecting the output */
+    uint64_t      output;       /**< hash of the output */
+    uint64_t      output_end;   /**< offset in output file after the output */
+    unsigned int  status;       /**< error status of the file, 0 if none */
+} journal_entry_t;
+
+uint64_t journal_hash(uint64_t hash, const void *data, size_t len);
+bool     journal_hash_range(int fd, uint64_t offset, uint64_t len, uint64_t *hash);
+bool     journal_hash_file(const char *path, uint64_t *hash);
+
+bool                   journal_open(const char *path);
+const journal_entry_t *journal_find(const char *path);
+const journal_entry_t *journal_last(void);
+bool                   journal_add(const char *path, uint64_t content, uint64_t config,
+                                   uint64_t output, uint64_t output_end, unsigned int status);
+bool                   journal_close(void);
+
+#endif
@@ -1,7 +1,7 @@
 /** \file   main.c
  * \brief   IF stack implementation test
  *
- * \note    Uses some POSIX functions like \c strcasecmp()
+ * \note    Uses some POSIX functions like \c basename()
  */
 
 /* Copyright (C) 2023  Bas Wassink
@@ -24,39 +24,169 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
-#include <strings.h>
-#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
+#include "assemble.h"
+#include "eval.h"
 #include "ifstack.h"
+#include "journal.h"
+#include "match.h"
+#include "metrics.h"
+#include "output.h"
+#include "profile.h"
+#include "reader.h"
+#include "reorder.h"
+#include "scan.h"
+#include "symbols.h"
+#include "table.h"
+#include "tar.h"
+#include "walk.h"
 
-/** \brief  Boolean value translation
+
+/** \brief  Default maximum number of bytes of output held in memory for
+ *          writing in order with \c --workers
  */
-typedef struct bvalue_s {
-    const char *text;   /**< text */
-    bool        value;  /**< boolean value */
-} bvalue_t;
+#define REORDER_CAP_DEFAULT (64u * 1024u * 1024u)
 
+/** \brief  Maximum number of threads for \c --jobs and \c --workers */
+#define MAX_THREADS         1024
 
-/** \brief  Line read from file for processing */
-static char line[256];
+/** \brief  Maximum number of files listed by \c --slowest */
+#define MAX_SLOWEST         100000
 
-/** \brief  Token buffer */
-static char token[sizeof line];
 
-/** \brief  Table of words to translate to boolean values
+/** \brief  Result of evaluating a file
+ *
+ * Recorded in the journal, except for \c FILE_ERR_IO, so a file is only
+ * evaluated again by a resumed run when its result could differ.
  */
-static const bvalue_t booleans[] = {
-    { "0",      false },
-    { "1",      true  },
-    { "false",  false },
-    { "true",   true  },
-    { "no",     false },
-    { "yes",    true  }
-};
+typedef enum file_status_e {
+    FILE_OK,        /**< evaluated and written without errors */
+    FILE_ERR_EVAL,  /**< evaluation error, reported, doesn't fail the file */
+    FILE_ERR_UTF8,  /**< rejected as invalid UTF-8 */
+    FILE_ERR_IO     /**< couldn't be opened or read, or the output couldn't be
+                         written */
+} file_status_t;
+
+/** \brief  Evaluation iterator of the main thread, reused for all files */
+static eval_iter_t iter;
+
+/** \brief  Only output live lines, without the table */
+static bool filter_mode = false;
+
+/** \brief  Maximum number of live lines to output per file, 0 for no limit */
+static uint64_t head_max = 0;
+
+/** \brief  Patterns to search for in live lines */
+static const char **grep_patterns;
+
+/** \brief  Lengths of the patterns in \c grep_patterns */
+static size_t *grep_lens;
 
+/** \brief  Number of patterns in \c grep_patterns */
+static int grep_count;
+
+/** \brief  Count live lines and bytes instead of outputting them */
+static bool count_mode = false;
+
+/** \brief  Number of live lines counted in all files */
+static uint64_t count_lines;
+
+/** \brief  Number of live bytes counted in all files */
+static uint64_t count_bytes;
+
+/** \brief  Number of threads formatting the table or writing the output, 1 to
+ *          print while evaluating
+ */
+static unsigned int jobs = 1;
+
+/** \brief  Record table rows for formatting after evaluation
+ *
+ * Set when the table is formatted in parallel.
+ */
+static bool table_mode = false;
+
+/** \brief  Record live lines for writing in parallel after evaluation
+ *
+ * Set when the output of filter mode is written in parallel.
+ */
+static bool assemble_mode = false;
+
+/** \brief  Inputs are tar archives, output is a tar archive of the results */
+static bool tar_mode = false;
+
+/** \brief  Traverse directories given on the command line */
+static bool recursive = false;
+
+/** \brief  Number of files parsed or skipped using the journal, for separating
+ *          the tables
+ *
+ * Skipped files count, because their tables are in the continued output.
+ */
+static unsigned int files_seen = 0;
+
+/** \brief  Hash of the options affecting the output, for the journal */
+static uint64_t config_hash = JOURNAL_HASH_INIT;
+
+/** \brief  File in the list of slowest files
+ */
+typedef struct slow_file_s {
+    char         *path;     /**< path to file */
+    double        seconds;  /**< time taken */
+    uint64_t      bytes;    /**< size of file */
+    unsigned int  depth;    /**< maximum stack depth */
+} slow_file_t;
+
+/** \brief  Slowest files seen, slowest first */
+static slow_file_t *slowest;
+
+/** \brief  Number of entries in \c slowest */
+static int slowest_count;
+
+/** \brief  Maximum number of entries in \c slowest, 0 to disable the list */
+static int slowest_max;
+
+/** \brief  Validate input as UTF-8 */
+static bool check_utf8 = false;
+
+/** \brief  Flush output after each line */
+static bool flush_lines = false;
+
+/** \brief  Flush output after this many bytes, 0 to disable */
+static uint64_t flush_bytes = 0;
+
+/** \brief  Flush output after this many seconds, 0 to disable */
+static double flush_interval = 0.0;
+
+/** \brief  Bytes written since the last flush */
+static uint64_t flush_pending = 0;
+
+/** \brief  Time of the last flush */
+static double flush_last = 0.0;
+
+/** \brief  Number of worker threads evaluating files, 0 to evaluate them on
+ *          the main thread
+ */
+static unsigned int workers = 0;
+
+/** \brief  Maximum number of bytes of output held in memory for writing in
+ *          order with \c --workers
+ */
+static size_t reorder_cap = REORDER_CAP_DEFAULT;
+
+/** \brief  Lock protecting the counts, the metrics and the slowest files */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** \brief  Lock protecting the journal's entries with \c --workers */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /** \brief  Print usage message on stdout
  *
@@ -64,121 +194,435 @@ static const bvalue_t booleans[] = {
  */
 static void usage(char *argv0)
 {
-    printf("usage: %s <filename>\n", basename(argv0));
+    printf("usage: %s [--count] [--cpu <level>] [--define <name>[=<value>]]\n"
+           "       [--exclude <glob>] [--filter] [--flush <policy>] [--grep <pattern>]\n"
+           "       [--head <n>] [--include <glob>] [--jobs <n>] [--journal <file>]\n"
+           "       [--metrics <file>] [--output <file>] [--profile <file>] [--recursive]\n"
+           "       [--reorder-cap <bytes>] [--slowest <n>] [--tar] [--utf8]\n"
+           "       [--workers <n>]\n"
+           "       <filename> [<filename> ...]\n",
+           basename(argv0));
+    printf("\n");
+    printf("  --count           count live lines and bytes, implies --filter\n");
+    printf("  --cpu <level>     use the scanning kernels of <level> (generic, sse2, avx2)\n"
+           "                    instead of the best the CPU supports\n");
+    printf("  --define <name>[=<value>]\n"
+           "                    define symbol <name> with value <value>, or 1\n");
+    printf("  --exclude <glob>  with --recursive, skip files and directories matching\n"
+           "                    <glob>, can be given multiple times\n");
+    printf("  --filter          only output live lines, without the table\n");
+    printf("  --flush <policy>  flush output after each line (line), after <n> bytes of\n"
+           "                    text (<n>) or <n> milliseconds (<n>ms)\n");
+    printf("  --grep <pattern>  only output live lines containing <pattern>, can be\n"
+           "                    given multiple times to match any of the patterns,\n"
+           "                    implies --filter\n");
+    printf("  --head <n>        only output the first <n> live lines of each file and\n"
+           "                    stop reading it, implies --filter\n");
+    printf("  --include <glob>  with --recursive, only process files matching <glob>,\n"
+           "                    can be given multiple times\n");
+    printf("  --jobs <n>        format the table, write the output of --filter or read\n"
+           "                    directories using <n> threads\n");
+    printf("  --journal <file>  record completed files in <file>, skip files completed\n"
+           "                    in a previous run with the same options\n");
+    printf("  --output <file>   write output to <file>, gzip-compressed if <file> ends\n"
+           "                    with .gz\n");
+    printf("  --metrics <file>  write metrics in Prometheus text format to <file>\n");
+    printf("  --profile <file>  write evaluations, live and dead lines and bytes, and time\n"
+           "                    per condition to <file>\n");
+    printf("  --recursive       process the files below directories given as <filename>\n");
+    printf("  --reorder-cap <bytes>\n"
+           "                    with --workers, hold at most <bytes> of output waiting\n"
+           "                    to be written in memory, spill the rest to temporary\n"
+           "                    files (default 64 MiB)\n");
+    printf("  --slowest <n>     list the <n> slowest files on stderr\n");
+    printf("  --tar             inputs are tar archives, write a tar archive of the\n"
+           "                    output of each member, implies --filter\n");
+    printf("  --utf8            reject input that isn't valid UTF-8\n");
+    printf("  --workers <n>     evaluate <n> files at the same time, writing their output\n"
+           "                    in order\n");
+}
+
+/** \brief  Get argument of command line option
+ *
+ * \param[in]       argc    argument count
+ * \param[in]       argv    argument vector
+ * \param[in,out]   i       index of option in \a argv, set to index of the
+ *                          option's argument
+ *
+ * \return  argument or \c NULL when missing
+ */
+static const char *option_arg(int argc, char *argv[], int *i)
+{
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "error: option '%s' requires an argument\n", argv[*i]);
+        return NULL;
+    }
+    *i += 1;
+    return argv[*i];
+}
+
+/** \brief  Parse numeric option argument
+ *
+ * \param[in]   arg     argument, decimal digits only
+ * \param[in]   min     minimum value
+ * \param[in]   max     maximum value
+ * \param[out]  value   value
+ *
+ * \return  \c false if \a arg isn't a number from \a min to \a max
+ */
+static bool option_number(const char *arg, uint64_t min, uint64_t max, uint64_t *value)
+{
+    char               *end;
+    unsigned long long  n;
+
+    /* strtoull() accepts leading white space and a sign */
+    if (*arg < '0' || *arg > '9') {
+        return false;
+    }
+    errno = 0;
+    n = strtoull(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || n < min || n > max) {
+        return false;
+    }
+    *value = n;
+    return true;
 }
 
-/** \brief  Get token from current line
+/** \brief  Parse flush policy
  *
- * \param[in]   pos position in \c line[]
+ * \param[in]   policy  "line", "<n>ms" or "<n>" (bytes)
  *
- * \return  position in \a line of first whitespace character or -1 when no
- *          token was encountered
+ * \return  \c false if \a policy is invalid
  */
-static int get_token(int pos)
+static bool flush_parse(const char *policy)
 {
-    int t;
+    char          *end;
+    unsigned long  n;
 
-    /* skip whitespace */
-    while (pos < (int)sizeof line - 1 && line[pos] != '\0' && isspace(line[pos])) {
-        pos++;
+    if (strcmp(policy, "line") == 0) {
+        flush_lines = true;
+    } else {
+        if (*policy < '0' || *policy > '9') {
+            return false;
+        }
+        errno = 0;
+        n = strtoul(policy, &end, 10);
+        if (errno != 0 || end == policy || n == 0) {
+            return false;
+        }
+        if (strcmp(end, "ms") == 0) {
+            flush_interval = (double)n / 1000.0;
+        } else if (*end == '\0') {
+            flush_bytes = n;
+        } else {
+            return false;
+        }
     }
-    if (line[pos] == '\0') {
-        /* no token */
-        token[0] = '\0';
-        return -1;
+    return true;
+}
+
+/** \brief  Flush pending output
+ */
+static void flush_output(void)
+{
+    fflush(stdout);
+    flush_pending = 0;
+    flush_last    = metrics_now();
+}
+
+/** \brief  Account for written output and flush according to the policy
+ *
+ * \param[in]   bytes   number of bytes written
+ */
+static void flush_wrote(uint64_t bytes)
+{
+    flush_pending += bytes;
+    if (flush_lines
+            || (flush_bytes > 0 && flush_pending >= flush_bytes)
+            || (flush_interval > 0.0 && metrics_now() - flush_last >= flush_interval)) {
+        flush_output();
     }
+}
 
-    t = 0;
-    while (pos < (int)sizeof line - 1 && line[pos] != '\0' && !isspace(line[pos])) {
-        token[t++] = line[pos++];
+/** \brief  Flush output before reading standard input
+ *
+ * Installed as the reader's wait hook for standard input: output is flushed
+ * when no input is available, so nothing is held back while waiting, and
+ * otherwise when the flush interval has passed.
+ *
+ * \param[in]   block   the read would block
+ */
+static void flush_wait(bool block)
+{
+    if (block || (flush_interval > 0.0 && metrics_now() - flush_last >= flush_interval)) {
+        flush_output();
     }
-    token[t] = '\0';
-    return pos;
 }
 
-/** \brief  Handle IF statement
+/** \brief  Add option to the configuration hash
  *
- * \param[in]   pos position in \c line[] after 'if'
+ * \param[in]   option  option or option argument affecting the output
+ */
+static void config_add(const char *option)
+{
+    config_hash = journal_hash(config_hash, option, strlen(option) + 1);
+}
+
+/** \brief  Get position in output
+ *
+ * \param[out]  pos position in output
  *
- * \return  \c false if argument to IF missing
+ * \return  \c false if the output isn't a regular file
  */
-static bool handle_if(int pos)
+static bool output_position(uint64_t *pos)
 {
-    bool state = true;  /* anything not explicitly false will be considered true */
+    struct stat st;
+    off_t       offset;
 
-    if (get_token(pos) < 0) {
-        printf("%s(): error: expected token after 'IF'\n", __func__);
+    fflush(stdout);
+    if (fstat(STDOUT_FILENO, &st) != 0 || !S_ISREG(st.st_mode)) {
         return false;
     }
-    for (size_t i = 0; i < sizeof booleans / sizeof booleans[0]; i++) {
-        if (strcasecmp(booleans[i].text, token) == 0) {
-            state = booleans[i].value;
-            break;
-        }
+    offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    if (offset < 0) {
+        return false;
     }
-
-    printf("%-40s  ", "");
-    ifstack_if(state);
+    *pos = (uint64_t)offset;
     return true;
 }
 
-/** \brief  Handle ELSE statement
+/** \brief  Test if file was completed in a previous run
  *
- * \return  \c false if not in an IF branch or already in ELSE branch
+ * \param[in]   path    path to input file
+ * \param[in]   content hash of the input file
+ * \param[out]  status  status of the file in the previous run
+ *
+ * \return  \c true if \a path is in the journal with the same content and
+ *          options
  */
-static bool handle_else(void)
+static bool journal_done(const char *path, uint64_t content, file_status_t *status)
 {
-    printf("%-40s  ", "");
-    return ifstack_else();
+    const journal_entry_t *done;
+    bool                   same;
+
+    pthread_mutex_lock(&journal_lock);
+    done = journal_find(path);
+    same = done != NULL && done->content == content && done->config == config_hash;
+    if (same) {
+        *status = (file_status_t)done->status;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return same;
 }
 
-/** \brief  Handle ENDIF statement
+/** \brief  Report file skipped using the journal
  *
- * \return  \c false if not in an IF or ELSE branch
+ * Errors of the previous run are reported again, so a resumed run fails
+ * like an uninterrupted one.
+ *
+ * \param[in]   path    path to input file
+ * \param[in]   status  status of the file in the previous run
+ *
+ * \return  \c false if the file failed in the previous run
  */
-static bool handle_endif(void)
+static bool journal_skip(const char *path, file_status_t status)
 {
-    printf("%-40s  ", "");
-    return ifstack_endif();
+    switch (status) {
+        case FILE_OK:
+            return true;
+        case FILE_ERR_EVAL:
+            fprintf(stderr, "warning: \"%s\": skipped, had evaluation errors in a previous run\n",
+                    path);
+            return true;
+        default:
+            fprintf(stderr, "error: \"%s\": skipped, was rejected as invalid UTF-8 in a previous run\n",
+                    path);
+            return false;
+    }
 }
 
-/** \brief  Handle normal text
+/** \brief  Record completed file in the journal
  *
- * Print text from input file if the current if-stack condition is \c true.
+ * The hash of the output is only recorded when the output is a regular file
+ * opened for reading, which is the case with <tt>--output \<file\></tt>.
+ *
+ * \param[in]   path    path to input file
+ * \param[in]   content hash of the input file
+ * \param[in]   start   position in output before the file's output, or
+ *                      \c UINT64_MAX if the output isn't a regular file
+ * \param[in]   status  status of the file
+ *
+ * \return  \c false on error writing the journal
  */
-static bool handle_text(void)
+static bool journal_record(const char *path, uint64_t content, uint64_t start,
+                           file_status_t status)
 {
-    printf("%-40s  ", ifstack_true() ? line : "");
+    uint64_t end    = 0;
+    uint64_t output = 0;
+    bool     ok;
+
+    if (start != UINT64_MAX && output_position(&end)
+            && !journal_hash_range(STDOUT_FILENO, start, end - start, &output)) {
+        output = 0;
+    }
+    pthread_mutex_lock(&journal_lock);
+    ok = journal_add(path, content, config_hash, output, end, (unsigned int)status);
+    pthread_mutex_unlock(&journal_lock);
+    if (!ok) {
+        fprintf(stderr, "error: failed to write journal: (%d) %s\n", errno, strerror(errno));
+        return false;
+    }
     return true;
 }
 
-/** \brief  Handle line of input from file
+/** \brief  Add pattern to search for
  *
- * \return  \c false on error
+ * \param[in]   pattern pattern
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
  */
-static bool handle_line(void)
+static void add_pattern(const char *pattern)
 {
-    bool result;
-    int  pos;
+    const char **patterns = realloc(grep_patterns, (size_t)(grep_count + 1) * sizeof *patterns);
+    size_t      *lens     = realloc(grep_lens, (size_t)(grep_count + 1) * sizeof *lens);
 
-    pos = get_token(0);
-    if (pos < 0) {
-        /* empty line */
-        result = handle_text();
-    } else {
-        if (strcasecmp(token, "if") == 0) {
-            result = handle_if(pos);
-        } else if (strcasecmp(token, "else") == 0) {
-            result = handle_else();
-        } else if (strcasecmp(token, "endif") == 0) {
-            result = handle_endif();
-        } else {
-            result = handle_text();
+    if (patterns == NULL || lens == NULL) {
+        fprintf(stderr, "%s(): failed to allocate memory, exiting.\n", __func__);
+        exit(1);
+    }
+    patterns[grep_count] = pattern;
+    lens[grep_count]     = strlen(pattern);
+    grep_patterns        = patterns;
+    grep_lens            = lens;
+    grep_count++;
+}
+
+/** \brief  Test if span of live text matches the search patterns
+ *
+ * \param[in]   span    span of live text
+ *
+ * \return  \c true if no patterns are given or \a span contains any of them
+ */
+static bool match_span(const eval_span_t *span)
+{
+    if (grep_count == 0) {
+        return true;
+    }
+    for (int i = 0; i < grep_count; i++) {
+        if (grep_lens[i] == 0
+                || scan_find(span->text, span->len, grep_patterns[i], grep_lens[i]) < span->len) {
+            return true;
         }
     }
-    ifstack_print();
-    putchar('\n');
-    return result;
+    return false;
+}
+
+/** \brief  Print table row
+ *
+ * Print line number, source, output and stack of an evaluated line. A
+ * directive missing its argument has no output column.
+ *
+ * \param[in]   el  evaluated line
+ * \param[in]   out stream to print to
+ */
+static void print_row(const eval_line_t *el, FILE *out)
+{
+    fprintf(out, "%4" PRIu64 "  %-40s  ", el->lineno, el->text);
+    if (el->status != EVAL_ERR_ARGUMENT) {
+        fprintf(out, "%-40s  ", el->live ? el->text : "");
+    }
+    ifstack_fprint(out);
+    putc('\n', out);
+}
+
+/** \brief  Record table row for parallel formatting
+ *
+ * \param[in]   el  evaluated line
+ */
+static void record_row(const eval_line_t *el)
+{
+    table_row(el->text, el->len);
+    if (el->status == EVAL_ERR_ARGUMENT) {
+        return;
+    }
+    table_output(el->live);
+    if (el->status != EVAL_OK) {
+        return;
+    }
+    switch (el->kind) {
+        case EVAL_IF:
+            table_if(ifstack_top());
+            break;
+        case EVAL_ELSE:
+            table_else();
+            break;
+        case EVAL_ENDIF:
+            table_endif();
+            break;
+        case EVAL_SWITCH:
+            table_switch();
+            break;
+        case EVAL_CASE:
+        case EVAL_DEFAULT:
+            table_case(ifstack_top());
+            break;
+        case EVAL_ENDSWITCH:
+            table_endswitch();
+            break;
+        default:
+            break;
+    }
+}
+
+/** \brief  Add file to the list of slowest files
+ *
+ * \param[in]   path    path to file
+ * \param[in]   seconds time taken
+ * \param[in]   bytes   size of file
+ * \param[in]   depth   maximum stack depth
+ */
+static void add_slowest(const char *path, double seconds, uint64_t bytes, unsigned int depth)
+{
+    int i;
+
+    if (slowest_count == slowest_max) {
+        if (slowest_max == 0 || seconds <= slowest[slowest_count - 1].seconds) {
+            return;
+        }
+        /* drop the fastest entry */
+        free(slowest[--slowest_count].path);
+    }
+
+    /* insertion sort, slowest first */
+    for (i = slowest_count; i > 0 && slowest[i - 1].seconds < seconds; i--) {
+        slowest[i] = slowest[i - 1];
+    }
+    slowest[i].path    = strdup(path);
+    slowest[i].seconds = seconds;
+    slowest[i].bytes   = bytes;
+    slowest[i].depth   = depth;
+    if (slowest[i].path == NULL) {
+        fprintf(stderr, "%s(): failed to allocate memory, exiting.\n", __func__);
+        exit(1);
+    }
+    slowest_count++;
+}
+
+/** \brief  Print list of slowest files on stderr and free it
+ */
+static void print_slowest(void)
+{
+    fprintf(stderr, "slowest files:\n");
+    fprintf(stderr, "%12s  %12s  %5s  %s\n", "seconds", "bytes", "depth", "path");
+    for (int i = 0; i < slowest_count; i++) {
+        fprintf(stderr, "%12.6f  %12" PRIu64 "  %5u  %s\n",
+                slowest[i].seconds, slowest[i].bytes, slowest[i].depth,
+                slowest[i].path);
+        free(slowest[i].path);
+    }
+    free(slowest);
+    slowest       = NULL;
+    slowest_count = 0;
 }
 
 /** \brief  Parse file and process IF/THEN/ELSE statements
@@ -186,57 +630,707 @@ static bool handle_line(void)
  * Parse \a path and handle IF/THEN/ELSE using the if-stack, printing normal
  * lines when the if-stack's global condition is true.
  *
- * \return  \a true on success
+ * The time taken to open, evaluate and write the output of the file is
+ * recorded in the latency histograms of the metrics. When the table is
+ * formatted in parallel the rows are recorded while evaluating and formatted
+ * in the write phase.
+ *
+ * Output written to \c stdout is flushed according to the flush policy and
+ * standard input is evaluated as it's read. Output written to another stream
+ * is left to the caller, which makes it safe to call from the workers of
+ * \c --workers, each with its own iterator.
+ *
+ * \param[in,out]   it      evaluation iterator
+ * \param[in]       path    path to file, or name of archive member
+ * \param[in]       fd      file descriptor to read \a size bytes of, or -1 to
+ *                          open \a path
+ * \param[in]       size    number of bytes to read from \a fd
+ * \param[in]       out     stream for the output
+ *
+ * \return  status of the file; evaluation errors are reported but don't make
+ *          the file fail
  */
-static bool parse(const char *path)
+static file_status_t parse(eval_iter_t *it, const char *path, int fd, uint64_t size,
+                           FILE *out)
 {
-    FILE *fp;
-    int   lineno;
+    eval_line_t  el;
+    eval_span_t  span;
+    uint64_t     count;
+    uint64_t     bytes_live;
+    uint64_t     bytes;
+    double       start;
+    double       opened;
+    double       evaluated;
+    double       end;
+    bool         direct;
+    bool         stream;
+    bool         table;
+    bool          assemble;
+    file_status_t status;
+    unsigned int  errors;
 
+    /* output of standard input is written as it's evaluated */
+    direct   = out == stdout;
+    stream   = direct && fd < 0 && strcmp(path, "-") == 0;
+    table    = table_mode && !stream;
+    assemble = assemble_mode && !stream;
+    it->reader.wait = stream ? flush_wait : NULL;
 
-    fp = fopen(path, "rb");
-    if (fp == NULL) {
+    start = metrics_now();
+    if (fd >= 0) {
+        eval_iter_open_fd(it, fd, size, check_utf8);
+    } else if (!eval_iter_open(it, path, check_utf8)) {
         fprintf(stderr, "error: failed to open \"%s\": (%d) %s\n",
                 path, errno, strerror(errno));
-        return false;
+        return FILE_ERR_IO;
     }
+    opened = metrics_now();
 
-    printf("line  source                                  "
-           "  output                                    stack\n");
-    printf("----  ----------------------------------------"
-           "  ----------------------------------------  -----\n");
+    count      = 0;
+    bytes_live = 0;
+    if (filter_mode) {
+        /* pull live lines, stop reading once we have enough */
+        if (assemble) {
+            assemble_reset();
+        }
+        while ((head_max == 0 || count < head_max) && eval_next_span(it, &span)) {
+            if (!match_span(&span)) {
+                continue;
+            }
+            if (assemble) {
+                assemble_add(span.offset, span.len);
+            } else if (!count_mode) {
+                fwrite(span.text, 1, span.len, out);
+                putc('\n', out);
+                if (ferror(out)) {
+                    break;
+                }
+                if (direct) {
+                    flush_wrote(span.len + 1);
+                }
+            }
+            count++;
+            bytes_live += span.len + 1;
+        }
+        if (count_mode) {
+            fprintf(out, "%12" PRIu64 " %12" PRIu64 " %s\n", count, bytes_live, path);
+        }
+    } else {
+        fprintf(out, "line  source                                  "
+                "  output                                    stack\n");
+        fprintf(out, "----  ----------------------------------------"
+                "  ----------------------------------------  -----\n");
 
-    lineno = 1;
-    do {
-        memset(line, 0, sizeof line);
-        if (fgets(line, (int)(sizeof line) - 1, fp) == NULL) {
-            break;
+        if (table) {
+            table_reset();
         }
-        int i = (int)strlen(line) - 1;
-        while (i >= 0 && isspace((unsigned char)line[i])) {
-            line[i--] = '\0';
+        while (eval_next_line(it, &el)) {
+            if (table) {
+                record_row(&el);
+            } else {
+                print_row(&el, out);
+                if (ferror(out)) {
+                    break;
+                }
+                if (direct) {
+                    flush_wrote(el.len + 1);
+                }
+            }
         }
+    }
 
-        printf("%4d  %-40s  ", lineno, line);
-        if (!handle_line()) {
+    status = FILE_OK;
+    errors = 0;
+    switch (it->error) {
+        case EVAL_OK:
+            break;
+        case EVAL_ERR_STACK:
             fprintf(stderr,
                     "%s(): error %d: %s\n",
                     __func__, ifstack_errno, ifstack_strerror(ifstack_errno));
-            goto cleanup;
+            status = FILE_ERR_EVAL;
+            break;
+        default:
+            /* the line that failed ended the evaluation */
+            fprintf(stderr, "error: \"%s\": line %" PRIu64 ": %s\n",
+                    path, it->lines, eval_strerror(it->error));
+            status = FILE_ERR_EVAL;
+            break;
+    }
+    if (status == FILE_ERR_EVAL) {
+        errors++;
+    } else if (it->reader.error == READER_ERR_UTF8) {
+        fprintf(stderr, "error: \"%s\": invalid UTF-8 at offset %" PRIu64 " (line %" PRIu64 ")\n",
+                path, it->reader.error_offset, it->lines + 1);
+        errors++;
+        status = FILE_ERR_UTF8;
+    } else if (it->reader.error == READER_ERR_IO) {
+        fprintf(stderr, "error: failed to read \"%s\"\n", path);
+        errors++;
+        status = FILE_ERR_IO;
+    }
+
+    evaluated = metrics_now();
+    if (table) {
+        table_write(jobs);
+    }
+    if (assemble && !assemble_write(it->reader.fd, jobs)) {
+        fprintf(stderr, "error: failed to write output of \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        errors++;
+        status = FILE_ERR_IO;
+    }
+    if (direct) {
+        flush_output();
+    }
+    if (ferror(out)) {
+        errors++;
+        status = FILE_ERR_IO;
+    }
+    end = metrics_now();
+
+    bytes = it->reader.offset + it->reader.pos;
+    eval_iter_close(it);
+
+    pthread_mutex_lock(&stats_lock);
+    count_lines += count;
+    count_bytes += bytes_live;
+    metrics.errors     += errors;
+    metrics.files++;
+    metrics.lines      += it->lines;
+    metrics.lines_live += it->lines_live;
+    metrics.directives += it->directives;
+    metrics.bytes      += bytes;
+    metrics.seconds    += end - start;
+    if (it->max_depth > metrics.max_depth) {
+        metrics.max_depth = it->max_depth;
+    }
+    metrics_record_latency(METRICS_PHASE_OPEN, opened - start);
+    metrics_record_latency(METRICS_PHASE_EVAL, evaluated - opened);
+    metrics_record_latency(METRICS_PHASE_WRITE, end - evaluated);
+    metrics_record_latency(METRICS_PHASE_TOTAL, end - start);
+    add_slowest(path, end - start, bytes, it->max_depth);
+    pthread_mutex_unlock(&stats_lock);
+    return status;
+}
+
+
+/** \brief  Evaluate the members of a tar archive
+ *
+ * Each regular file in the archive is evaluated as it's read and its live
+ * lines are written as a member with the same name to the tar archive on
+ * \c stdout. The archive is read sequentially, so it can be a pipe.
+ *
+ * \param[in]   path    path to archive, "-" for standard input
+ *
+ * \return  \c false on error
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static bool parse_archive(const char *path)
+{
+    tar_member_t  member;
+    char         *data = NULL;
+    size_t        size = 0;
+    int           fd;
+    int           result;
+    bool          ok = true;
+
+    fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "error: failed to open \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        return false;
+    }
+
+    tar_open(fd);
+    while ((result = tar_next(&member)) == TAR_MEMBER) {
+        FILE *out = open_memstream(&data, &size);
+
+        if (out == NULL) {
+            fprintf(stderr, "%s(): failed to open memory stream, exiting.\n", __func__);
+            exit(1);
+        }
+        parse(&iter, member.name, fd, member.size, out);
+        tar_consumed(member.size - iter.reader.remain);
+        if (fclose(out) != 0) {
+            fprintf(stderr, "%s(): failed to allocate memory, exiting.\n", __func__);
+            exit(1);
+        }
+        if (!tar_write(stdout, &member, data, size)) {
+            fprintf(stderr, "error: failed to write \"%s\": (%d) %s\n",
+                    member.name, errno, strerror(errno));
+            ok = false;
+        }
+        free(data);
+        data = NULL;
+        if (!ok || iter.reader.error == READER_ERR_IO) {
+            break;
+        }
+    }
+    if (ok && result != TAR_END) {
+        fprintf(stderr, "error: \"%s\": %s\n", path, tar_strerror(result));
+        ok = false;
+    }
+
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return ok;
+}
+
+
+/** \brief  Process input file
+ *
+ * With \c --tar the file is an archive whose members are evaluated, see
+ * parse_archive(); the journal isn't used then. Otherwise the file is
+ * evaluated with parse(), preceded by a "Parsing" header and separated from
+ * the previous table by an empty line when printing tables.
+ *
+ * When the journal is used a file completed in a previous run with the same
+ * content and options is skipped and counted in \a skipped. A file is
+ * recorded in the journal with its status, and the hash of its output if the
+ * output is a regular file, when it was read and its output written, also
+ * when it had evaluation errors or was rejected as invalid UTF-8: its output
+ * is the same when evaluated again, so a resumed run continues the output
+ * after it instead of appending it after the files that follow it. Standard
+ * input is never skipped or recorded.
+ *
+ * \param[in]       path        path to file, "-" for standard input
+ * \param[in]       journal     use the journal
+ * \param[in,out]   skipped     number of files skipped using the journal
+ *
+ * \return  \c false if the file or archive couldn't be read or hashed, or
+ *          its output or the journal couldn't be written
+ */
+static bool process_file(const char *path, bool journal, int *skipped)
+{
+    uint64_t      content = 0;
+    uint64_t      start   = UINT64_MAX;
+    file_status_t status;
+
+    if (tar_mode) {
+        return parse_archive(path);
+    }
+
+    /* standard input can't be hashed or read again */
+    if (journal && strcmp(path, "-") != 0) {
+        if (!journal_hash_file(path, &content)) {
+            fprintf(stderr, "error: failed to read \"%s\": (%d) %s\n",
+                    path, errno, strerror(errno));
+            return false;
+        }
+        if (journal_done(path, content, &status)) {
+            (*skipped)++;
+            files_seen++;
+            return journal_skip(path, status);
+        }
+        if (!output_position(&start)) {
+            start = UINT64_MAX;
+        }
+    }
+
+    if (!filter_mode) {
+        if (files_seen > 0) {
+            putchar('\n');
+        }
+        printf("Parsing \"%s\"\n", path);
+    }
+    files_seen++;
+    status = parse(&iter, path, -1, 0, stdout);
+    if (status == FILE_ERR_IO) {
+        return false;
+    }
+    if (journal && strcmp(path, "-") != 0 && !journal_record(path, content, start, status)) {
+        return false;
+    }
+    return status != FILE_ERR_UTF8;
+}
+
+/** \brief  Process the files below a directory
+ *
+ * Files are processed in sorted order as soon as the traversal threads have
+ * read their directories.
+ *
+ * \param[in]       root        path to directory
+ * \param[in]       journal     use the journal
+ * \param[in,out]   skipped     number of files skipped using the journal
+ *
+ * \return  \c false on error
+ */
+static bool process_dir(const char *root, bool journal, int *skipped)
+{
+    char *path;
+    bool  ok;
+
+    if (!walk_start(root, jobs)) {
+        return false;
+    }
+    ok = true;
+    while ((path = walk_next()) != NULL) {
+        if (!process_file(path, journal, skipped)) {
+            ok = false;
+        }
+        free(path);
+        if (ferror(stdout)) {
+            break;
+        }
+    }
+    return walk_finish() && ok;
+}
+
+
+/** \brief  File evaluated by a worker with \c --workers
+ */
+typedef struct batch_job_s {
+    struct batch_job_s *next;       /**< next job in the queue */
+    char               *path;       /**< path to file */
+    uint64_t            seq;        /**< sequence number for the reorder buffer */
+    uint64_t            content;    /**< hash of the file for the journal */
+    bool                skipped;    /**< completed in a previous run */
+    bool                evaluated;  /**< evaluated, output is in the buffer */
+    file_status_t       status;     /**< result of parse(), or of the previous
+                                         run when skipped */
+} batch_job_t;
+
+/** \brief  Jobs waiting for a worker, in order */
+static batch_job_t *batch_head;
+
+/** \brief  Last job in \c batch_head */
+static batch_job_t *batch_tail;
+
+/** \brief  No more jobs will be queued */
+static bool batch_closed;
+
+/** \brief  Don't evaluate the remaining jobs, the output failed */
+static bool batch_stopped;
+
+/** \brief  Use the journal in the workers */
+static bool batch_journal;
+
+/** \brief  Lock protecting the queue */
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** \brief  Signalled when a job is queued or the queue is closed */
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+
+
+/** \brief  Evaluate file of a job and put its output in the reorder buffer
+ *
+ * The journal is checked here, since hashing the file reads all of it. The
+ * "Parsing" header and the journal entry are written by the main thread when
+ * it's the file's turn.
+ *
+ * \param[in,out]   it  evaluation iterator of the worker
+ * \param[in,out]   job job
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void batch_eval(eval_iter_t *it, batch_job_t *job)
+{
+    FILE   *out;
+    char   *data = NULL;
+    size_t  size = 0;
+    bool    stopped;
+
+    pthread_mutex_lock(&batch_lock);
+    stopped = batch_stopped;
+    pthread_mutex_unlock(&batch_lock);
+    if (stopped) {
+        reorder_put(job->seq, NULL, 0, job);
+        return;
+    }
+
+    if (batch_journal && strcmp(job->path, "-") != 0) {
+        if (!journal_hash_file(job->path, &job->content)) {
+            fprintf(stderr, "error: failed to read \"%s\": (%d) %s\n",
+                    job->path, errno, strerror(errno));
+            reorder_put(job->seq, NULL, 0, job);
+            return;
         }
+        if (journal_done(job->path, job->content, &job->status)) {
+            job->skipped = true;
+            reorder_put(job->seq, NULL, 0, job);
+            return;
+        }
+    }
+
+    out = open_memstream(&data, &size);
+    if (out == NULL) {
+        fprintf(stderr, "%s(): failed to open memory stream, exiting.\n", __func__);
+        exit(1);
+    }
+    job->evaluated = true;
+    job->status    = parse(it, job->path, -1, 0, out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "%s(): failed to allocate memory, exiting.\n", __func__);
+        exit(1);
+    }
+    reorder_put(job->seq, data, size, job);
+}
+
+/** \brief  Worker thread
+ *
+ * Evaluates queued files until the queue is closed and empty.
+ *
+ * \param[in]   arg unused
+ *
+ * \return  \c NULL
+ */
+static void *batch_worker(void *arg)
+{
+    eval_iter_t  it;
+    batch_job_t *job;
+
+    (void)arg;
+    eval_iter_init(&it);
+    for (;;) {
+        pthread_mutex_lock(&batch_lock);
+        while (batch_head == NULL && !batch_closed) {
+            pthread_cond_wait(&batch_cond, &batch_lock);
+        }
+        job = batch_head;
+        if (job != NULL) {
+            batch_head = job->next;
+            if (batch_head == NULL) {
+                batch_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&batch_lock);
+        if (job == NULL) {
+            break;
+        }
+        batch_eval(&it, job);
+    }
+    eval_iter_free(&it);
+    return NULL;
+}
+
+/** \brief  Queue file for the workers
+ *
+ * \param[in]   path    path to file, freed with the job
+ * \param[in]   seq     sequence number of the file
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void batch_submit(char *path, uint64_t seq)
+{
+    batch_job_t *job = calloc(1, sizeof *job);
+
+    if (job == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, sizeof *job);
+        exit(1);
+    }
+    job->path = path;
+    job->seq  = seq;
+
+    pthread_mutex_lock(&batch_lock);
+    if (batch_tail != NULL) {
+        batch_tail->next = job;
+    } else {
+        batch_head = job;
+    }
+    batch_tail = job;
+    pthread_cond_signal(&batch_cond);
+    pthread_mutex_unlock(&batch_lock);
+}
+
+/** \brief  Write the output of the next file in order
+ *
+ * Writes the output of the next file like process_file() would: preceded by
+ * a "Parsing" header and an empty line between tables, and recorded in the
+ * journal unless it couldn't be read or written. Once writing
+ * the output fails the workers are stopped and the outputs of the remaining
+ * files are discarded.
+ *
+ * \param[in]       wait    wait for the next file to be evaluated
+ * \param[in,out]   skipped number of files skipped using the journal
+ * \param[in,out]   ok      set to \c false on error
+ *
+ * \return  \c false if the next file hasn't been evaluated and \a wait is
+ *          \c false
+ */
+static bool batch_emit(bool wait, int *skipped, bool *ok)
+{
+    batch_job_t *job;
+    uint64_t     start = UINT64_MAX;
+    bool         failed;
+    bool         done  = true;
 
-        lineno++;
-    } while (!feof(fp));
+    job = reorder_take(wait);
+    if (job == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&batch_lock);
+    failed = batch_stopped;
+    pthread_mutex_unlock(&batch_lock);
 
-cleanup:
-    fclose(fp);
+    if (failed) {
+        reorder_write(NULL);
+    } else if (job->skipped) {
+        reorder_write(NULL);
+        (*skipped)++;
+        files_seen++;
+        done = journal_skip(job->path, job->status);
+    } else if (job->evaluated) {
+        if (batch_journal && strcmp(job->path, "-") != 0 && !output_position(&start)) {
+            start = UINT64_MAX;
+        }
+        if (!filter_mode) {
+            if (files_seen > 0) {
+                putchar('\n');
+            }
+            printf("Parsing \"%s\"\n", job->path);
+        }
+        files_seen++;
+        if (!reorder_write(stdout)) {
+            job->status = FILE_ERR_IO;
+        }
+        flush_output();
+        if (ferror(stdout)) {
+            job->status = FILE_ERR_IO;
+        }
+        if (job->status != FILE_ERR_IO && batch_journal && strcmp(job->path, "-") != 0
+                && !journal_record(job->path, job->content, start, job->status)) {
+            job->status = FILE_ERR_IO;
+        }
+        done = job->status != FILE_ERR_IO && job->status != FILE_ERR_UTF8;
+    } else {
+        /* couldn't be hashed */
+        reorder_write(NULL);
+        done = false;
+    }
+
+    if (!done && !failed) {
+        *ok = false;
+    }
+    if (ferror(stdout) && !failed) {
+        pthread_mutex_lock(&batch_lock);
+        batch_stopped = true;
+        pthread_mutex_unlock(&batch_lock);
+    }
+    free(job->path);
+    free(job);
     return true;
 }
 
+/** \brief  Process the files given on the command line with worker threads
+ *
+ * The files, and with \c --recursive the files below directories, are
+ * queued for \c workers threads in order. Each worker evaluates a file into
+ * memory and puts its output in the reorder buffer, from which the main
+ * thread writes the outputs in order as they become available, while
+ * queueing the remaining files. Outputs that are done before their turn are
+ * spilled to temporary files once they take more than \c reorder_cap bytes,
+ * so a slow file doesn't make memory use grow with the number of files
+ * behind it; the outputs of the files being evaluated are in memory as well.
+ *
+ * \param[in]       paths   paths to files and directories
+ * \param[in]       npaths  number of paths in \a paths
+ * \param[in]       journal use the journal
+ * \param[in,out]   skipped number of files skipped using the journal
+ *
+ * \return  \c false on error
+ *
+ * \note    Calls \c exit(1) on out-of-memory or when the threads can't be
+ *          created.
+ */
+static bool process_batch(char **paths, int npaths, bool journal, int *skipped)
+{
+    pthread_t *threads;
+    uint64_t   submitted = 0;
+    uint64_t   emitted   = 0;
+    bool       ok        = true;
+
+    threads = malloc(workers * sizeof *threads);
+    if (threads == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, workers * sizeof *threads);
+        exit(1);
+    }
+    batch_journal = journal;
+    reorder_open(reorder_cap);
+    for (unsigned int t = 0; t < workers; t++) {
+        if (pthread_create(&threads[t], NULL, batch_worker, NULL) != 0) {
+            fprintf(stderr, "%s(): failed to create thread, exiting.\n", __func__);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < npaths && !ferror(stdout); i++) {
+        const char  *path = paths[i];
+        char        *file;
+        struct stat  st;
+
+        if (recursive && stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (!walk_start(path, jobs)) {
+                ok = false;
+                continue;
+            }
+            while ((file = walk_next()) != NULL) {
+                batch_submit(file, submitted++);
+                /* write what's done meanwhile, the walk can be long */
+                while (batch_emit(false, skipped, &ok)) {
+                    emitted++;
+                }
+                if (ferror(stdout)) {
+                    break;
+                }
+            }
+            if (!walk_finish()) {
+                ok = false;
+            }
+        } else {
+            file = strdup(path);
+            if (file == NULL) {
+                fprintf(stderr, "%s(): failed to allocate memory, exiting.\n", __func__);
+                exit(1);
+            }
+            batch_submit(file, submitted++);
+        }
+        while (batch_emit(false, skipped, &ok)) {
+            emitted++;
+        }
+    }
+
+    pthread_mutex_lock(&batch_lock);
+    batch_closed = true;
+    pthread_cond_broadcast(&batch_cond);
+    pthread_mutex_unlock(&batch_lock);
+
+    while (emitted < submitted) {
+        batch_emit(true, skipped, &ok);
+        emitted++;
+    }
+    for (unsigned int t = 0; t < workers; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    reorder_close();
+    return ok;
+}
+
 
 /** \brief  Program driver
  *
- * Parse file in argv[1] to test the if-stack implementation.
+ * Parse the files given on the command line to test the if-stack
+ * implementation. Files are parsed one after the other, resetting the stack
+ * in between, so output is in command line order and memory use doesn't grow
+ * with the number of files.
+ *
+ * When <tt>--metrics \<file\></tt> is given the evaluation metrics are
+ * written to \<file\> after parsing. With <tt>--output \<file\></tt> the
+ * output is written to \<file\> instead of \c stdout. With
+ * <tt>--jobs \<n\></tt> the table is formatted, or the output of filter mode
+ * is written, by \<n\> threads after evaluating each file. With \c --tar the
+ * inputs are tar archives, see parse_archive(). With \c --recursive the files
+ * below directories are processed while \<n\> threads look for them. With
+ * <tt>--workers \<n\></tt> \<n\> files are evaluated at the same time, see
+ * process_batch().
  *
  * \param[in]   argc    argument count
  * \param[in]   argv    argument vector
@@ -245,23 +1339,301 @@ cleanup:
  */
 int main(int argc, char *argv[])
 {
-    int status = EXIT_SUCCESS;
+    const char *metrics_path = NULL;
+    const char *output_path  = NULL;
+    const char *journal_path = NULL;
+    const char *profile_path = NULL;
+    const char *cpu_level    = NULL;
+    int         npaths       = 0;
+    int         skipped      = 0;
+    int         status       = EXIT_SUCCESS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            metrics_path = option_arg(argc, argv, &i);
+            if (metrics_path == NULL) {
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--journal") == 0) {
+            journal_path = option_arg(argc, argv, &i);
+            if (journal_path == NULL) {
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output_path = option_arg(argc, argv, &i);
+            if (output_path == NULL) {
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile_path = option_arg(argc, argv, &i);
+            if (profile_path == NULL) {
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--slowest") == 0) {
+            const char *arg = option_arg(argc, argv, &i);
+            uint64_t    n;
+
+            if (arg == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (!option_number(arg, 1, MAX_SLOWEST, &n)) {
+                fprintf(stderr, "error: invalid number of files '%s' (1-%d)\n",
+                        arg, MAX_SLOWEST);
+                return EXIT_FAILURE;
+            }
+            slowest_max = (int)n;
+        } else if (strcmp(argv[i], "--cpu") == 0) {
+            cpu_level = option_arg(argc, argv, &i);
+            if (cpu_level == NULL) {
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--define") == 0) {
+            const char *arg = option_arg(argc, argv, &i);
+
+            if (arg == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (!symbols_define(arg)) {
+                fprintf(stderr, "error: invalid symbol definition '%s'\n", arg);
+                return EXIT_FAILURE;
+            }
+            config_add(argv[i - 1]);
+            config_add(arg);
+        } else if (strcmp(argv[i], "--count") == 0) {
+            count_mode  = true;
+            filter_mode = true;
+            config_add(argv[i]);
+        } else if (strcmp(argv[i], "--grep") == 0) {
+            const char *arg = option_arg(argc, argv, &i);
+
+            if (arg == NULL) {
+                return EXIT_FAILURE;
+            }
+            add_pattern(arg);
+            filter_mode = true;
+            config_add(argv[i - 1]);
+            config_add(arg);
+        } else if (strcmp(argv[i], "--head") == 0) {
+            const char *arg = option_arg(argc, argv, &i);
+
+            if (arg == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (!option_number(arg, 1, UINT64_MAX, &head_max)) {
+                fprintf(stderr, "error: invalid number of lines '%s' (1 or more)\n", arg);
+                return EXIT_FAILURE;
+            }
+            filter_mode = true;
+            config_add(argv[i - 1]);
+            config_add(arg);
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            const char *arg = option_arg(argc, argv, &i);
+            uint64_t    n;
+
+            if (arg == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (!option_number(arg, 1, MAX_THREADS, &n)) {
+                fprintf(stderr, "error: invalid number of jobs '%s' (1-%d)\n",
+                        arg, MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            jobs = (unsigned int)n;
+        } else if (strcmp(argv[i], "--workers") == 0) {
+            const char *arg = option_arg(argc, argv, &i);
+            uint64_t    n;
+
+            if (arg == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (!option_number(arg, 1, MAX_THREADS, &n)) {
+                fprintf(stderr, "error: invalid number of workers '%s' (1-%d)\n",
+                        arg, MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            workers = (unsigned int)n;
+        } else if (strcmp(argv[i], "--reorder-cap") == 0) {
+            const char *arg = option_arg(argc, argv, &i);
+            uint64_t    n;
+
+            if (arg == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (!option_number(arg, 0, SIZE_MAX, &n)) {
+                fprintf(stderr, "error: invalid number of bytes '%s'\n", arg);
+                return EXIT_FAILURE;
+            }
+            reorder_cap = (size_t)n;
+        } else if (strcmp(argv[i], "--flush") == 0) {
+            const char *arg = option_arg(argc, argv, &i);
+
+            if (arg == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (!flush_parse(arg)) {
+                fprintf(stderr, "error: invalid flush policy '%s'\n", arg);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--filter") == 0) {
+            filter_mode = true;
+            config_add(argv[i]);
+        } else if (strcmp(argv[i], "--recursive") == 0) {
+            recursive = true;
+        } else if (strcmp(argv[i], "--include") == 0 || strcmp(argv[i], "--exclude") == 0) {
+            const char *arg = option_arg(argc, argv, &i);
 
-    if (argc < 2) {
+            if (arg == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (strcmp(argv[i - 1], "--include") == 0) {
+                walk_include(arg);
+            } else {
+                walk_exclude(arg);
+            }
+        } else if (strcmp(argv[i], "--tar") == 0) {
+            tar_mode    = true;
+            filter_mode = true;
+            config_add(argv[i]);
+        } else if (strcmp(argv[i], "--utf8") == 0) {
+            check_utf8 = true;
+            config_add(argv[i]);
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "error: unknown option '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        } else {
+            /* collect paths at the start of argv[] (after argv[0]) */
+            argv[1 + npaths++] = argv[i];
+        }
+    }
+    if (npaths == 0) {
         usage(argv[0]);
         return EXIT_FAILURE;
-    } else if (strcmp(argv[1], "--help") == 0) {
-        usage(argv[0]);
-        return EXIT_SUCCESS;
     }
 
-    ifstack_init();
+    if (!scan_init(cpu_level)) {
+        fprintf(stderr, "error: CPU level '%s' unknown or not supported\n", cpu_level);
+        return EXIT_FAILURE;
+    }
+
+    if (tar_mode && (count_mode || journal_path != NULL)) {
+        fprintf(stderr, "error: --tar can't be combined with --count or --journal\n");
+        return EXIT_FAILURE;
+    }
+
+    if (workers > 0 && (tar_mode || profile_path != NULL)) {
+        fprintf(stderr, "error: --workers can't be combined with --tar or --profile\n");
+        return EXIT_FAILURE;
+    }
+    if (workers > 0 && !IFSTACK_PER_THREAD) {
+        /* built as C99: one if-stack for all threads */
+        fprintf(stderr, "error: --workers requires a C11 build\n");
+        return EXIT_FAILURE;
+    }
+
+    /* with workers --jobs only sets the number of traversal threads */
+    table_mode    = !filter_mode && jobs > 1 && workers == 0;
+    assemble_mode = filter_mode && !count_mode && !tar_mode && jobs > 1 && workers == 0;
+
+    if (journal_path != NULL && !journal_open(journal_path)) {
+        return EXIT_FAILURE;
+    }
+    if (output_path != NULL) {
+        const journal_entry_t *last = journal_path != NULL ? journal_last() : NULL;
+
+        /* continue the output of the previous run with the same options */
+        if (last != NULL && last->config == config_hash) {
+            if (!output_resume(output_path, last->output_end)) {
+                return EXIT_FAILURE;
+            }
+        } else if (!output_open(output_path)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (slowest_max > 0) {
+        slowest = malloc((size_t)slowest_max * sizeof *slowest);
+        if (slowest == NULL) {
+            fprintf(stderr, "error: failed to allocate memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    eval_iter_init(&iter);
+    iter.profile = profile_path != NULL;
 
-    printf("Parsing \"%s\"\n", argv[1]);
-    if (!parse(argv[1])) {
+    if (workers > 0) {
+        if (!process_batch(argv + 1, npaths, journal_path != NULL, &skipped)) {
+            status = EXIT_FAILURE;
+        }
+        if (ferror(stdout)) {
+            fprintf(stderr, "error: failed to write output\n");
+            status = EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < npaths && workers == 0; i++) {
+        const char  *path = argv[1 + i];
+        struct stat  st;
+
+        if (recursive && stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (!process_dir(path, journal_path != NULL, &skipped)) {
+                status = EXIT_FAILURE;
+            }
+        } else if (!process_file(path, journal_path != NULL, &skipped)) {
+            status = EXIT_FAILURE;
+        }
+        if (ferror(stdout)) {
+            /* don't evaluate the remaining files for nothing */
+            fprintf(stderr, "error: failed to write output\n");
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    if (tar_mode && !tar_finish(stdout)) {
+        fprintf(stderr, "error: failed to write archive: (%d) %s\n", errno, strerror(errno));
         status = EXIT_FAILURE;
     }
 
-    ifstack_free();
+    eval_iter_free(&iter);
+    tar_free();
+    walk_free();
+    table_free();
+    assemble_free();
+    symbols_free();
+    match_free();
+    free(grep_patterns);
+    free(grep_lens);
+
+    if (count_mode && files_seen > 1) {
+        printf("%12" PRIu64 " %12" PRIu64 " total\n", count_lines, count_bytes);
+    }
+
+    if (slowest_max > 0) {
+        print_slowest();
+    }
+
+    if (journal_path != NULL) {
+        if (skipped > 0) {
+            fprintf(stderr, "journal: skipped %d files completed in a previous run\n", skipped);
+        }
+        if (!journal_close()) {
+            fprintf(stderr, "error: failed to write journal: (%d) %s\n", errno, strerror(errno));
+            status = EXIT_FAILURE;
+        }
+    }
+
+    if (output_path != NULL && !output_close()) {
+        status = EXIT_FAILURE;
+    }
+    if (metrics_path != NULL && !metrics_write(metrics_path)) {
+        status = EXIT_FAILURE;
+    }
+    if (profile_path != NULL && !profile_write(profile_path)) {
+        status = EXIT_FAILURE;
+    }
+    profile_free();
     return status;
 }
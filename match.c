@@ -0,0 +1,232 @@
+/** \file   match.c
+ * \brief   Cached regular expression matching
+ *
+ * Matches values against POSIX extended regular expressions for the
+ * \c match() predicate of IF statements. Each distinct pattern is compiled
+ * once and kept in a hash table for the rest of the run, so a pattern used
+ * in thousands of conditions or files is only compiled the first time.
+ *
+ * Patterns are given as written between the quotes of the predicate: an
+ * escaped quote (<tt>\"</tt>) stands for a quote and an escaped backslash
+ * (<tt>\\</tt>) for a backslash, other backslashes are passed to the regular
+ * expression as is. The same rule finds the closing quote in eval.c.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <regex.h>
+#include <pthread.h>
+
+#include "symbols.h"
+#include "match.h"
+
+
+/** \brief  Initial number of slots in the pattern cache */
+#define MATCH_INITIAL_SIZE  64
+
+
+/** \brief  Compiled pattern
+ */
+typedef struct pattern_s {
+    char     *text;     /**< pattern as written, \c NULL for an empty slot */
+    size_t    len;      /**< length of \c text */
+    uint32_t  hash;     /**< hash of \c text */
+    bool      valid;    /**< pattern compiled, \c regex is valid */
+    regex_t   regex;    /**< compiled pattern */
+} pattern_t;
+
+
+/** \brief  Pattern cache, open addressing with linear probing */
+static pattern_t *cache;
+
+/** \brief  Number of slots in \c cache */
+static size_t cache_size;
+
+/** \brief  Number of patterns in \c cache */
+static size_t cache_count;
+
+/** \brief  Lock protecting the cache
+ *
+ * Held while matching as well, since growing the cache moves the compiled
+ * patterns.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** \brief  Allocate zeroed memory
+ *
+ * \param[in]   size    number of bytes
+ *
+ * \return  memory
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void *match_calloc(size_t size)
+{
+    void *ptr = calloc(1, size);
+
+    if (ptr == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, size);
+        exit(1);
+    }
+    return ptr;
+}
+
+/** \brief  Find slot for pattern
+ *
+ * \param[in]   text    pattern
+ * \param[in]   len     length of \a text
+ * \param[in]   hash    hash of \a text
+ *
+ * \return  slot containing \a text or the empty slot where it belongs
+ */
+static pattern_t *match_find(const char *text, size_t len, uint32_t hash)
+{
+    size_t mask = cache_size - 1;
+
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        pattern_t *p = &cache[i];
+
+        if (p->text == NULL
+                || (p->hash == hash && p->len == len && memcmp(p->text, text, len) == 0)) {
+            return p;
+        }
+    }
+}
+
+/** \brief  Double the size of the pattern cache
+ *
+ * Compiled patterns are moved, not recompiled.
+ */
+static void match_grow(void)
+{
+    pattern_t *old      = cache;
+    size_t     old_size = cache_size;
+
+    cache_size = cache_size > 0 ? cache_size * 2 : MATCH_INITIAL_SIZE;
+    cache      = match_calloc(cache_size * sizeof *cache);
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].text != NULL) {
+            *match_find(old[i].text, old[i].len, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+}
+
+/** \brief  Compile pattern into cache slot
+ *
+ * \param[out]  p       empty slot
+ * \param[in]   text    pattern as written
+ * \param[in]   len     length of \a text
+ * \param[in]   hash    hash of \a text
+ */
+static void match_compile(pattern_t *p, const char *text, size_t len, uint32_t hash)
+{
+    char   *unescaped = match_calloc(len + 1);
+    size_t  n         = 0;
+    int     result;
+
+    p->text = match_calloc(len + 1);
+    memcpy(p->text, text, len);
+    p->len  = len;
+    p->hash = hash;
+
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\\' && i + 1 < len && (text[i + 1] == '"' || text[i + 1] == '\\')) {
+            i++;
+        }
+        unescaped[n++] = text[i];
+    }
+    unescaped[n] = '\0';
+
+    result = regcomp(&p->regex, unescaped, REG_EXTENDED | REG_NOSUB);
+    if (result != 0) {
+        char msg[256];
+
+        regerror(result, &p->regex, msg, sizeof msg);
+        fprintf(stderr, "%s(): error: invalid pattern \"%s\": %s\n", __func__, p->text, msg);
+    }
+    p->valid = result == 0;
+    free(unescaped);
+    cache_count++;
+}
+
+
+/** \brief  Match value against pattern
+ *
+ * The pattern is compiled on first use. An invalid pattern is reported once
+ * and fails on every use. Can be called from multiple threads.
+ *
+ * \param[in]   pattern pattern as written
+ * \param[in]   len     length of \a pattern
+ * \param[in]   value   nul-terminated value to match
+ * \param[out]  matched \a value matches \a pattern
+ *
+ * \return  \c false if \a pattern is invalid
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+bool match_test(const char *pattern, size_t len, const char *value, bool *matched)
+{
+    uint32_t   hash = symbols_hash(pattern, len);
+    pattern_t *p;
+    bool       valid;
+
+    pthread_mutex_lock(&cache_lock);
+    if ((cache_count + 1) * 2 > cache_size) {
+        match_grow();
+    }
+    p = match_find(pattern, len, hash);
+    if (p->text == NULL) {
+        match_compile(p, pattern, len, hash);
+    }
+    valid = p->valid;
+    if (valid) {
+        *matched = regexec(&p->regex, value, 0, NULL, 0) == 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return valid;
+}
+
+
+/** \brief  Free the pattern cache
+ */
+void match_free(void)
+{
+    for (size_t i = 0; i < cache_size; i++) {
+        if (cache[i].text != NULL) {
+            if (cache[i].valid) {
+                regfree(&cache[i].regex);
+            }
+            free(cache[i].text);
+        }
+    }
+    free(cache);
+    cache       = NULL;
+    cache_size  = 0;
+    cache_count = 0;
+}
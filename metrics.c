@@ -0,0 +1,200 @@
+/** \file   metrics.c
+ * \brief   Evaluation metrics
+ *
+ * Export parser counters in the Prometheus text exposition format.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "metrics.h"
+
+
+/** \brief  Global metrics
+ */
+metrics_t metrics;
+
+/** \brief  Names of the phases, used as label values */
+static const char *phase_names[METRICS_PHASE_COUNT] = {
+    "open", "evaluate", "write", "total"
+};
+
+/** \brief  Quantiles reported for the latency histograms */
+static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+
+/** \brief  Write a single metric in Prometheus text format
+ *
+ * \param[in]   fp      file to write to
+ * \param[in]   name    metric name
+ * \param[in]   type    metric type ("counter" or "gauge")
+ * \param[in]   help    description of the metric
+ * \param[in]   value   metric value
+ */
+static void write_metric(FILE       *fp,
+                         const char *name,
+                         const char *type,
+                         const char *help,
+                         double      value)
+{
+    fprintf(fp, "# HELP %s %s\n", name, help);
+    fprintf(fp, "# TYPE %s %s\n", name, type);
+    fprintf(fp, "%s %.17g\n", name, value);
+}
+
+
+/** \brief  Write latency histograms as a Prometheus summary
+ *
+ * \param[in]   fp  file to write to
+ */
+static void write_latency(FILE *fp)
+{
+    const char *name = "ifstack_file_latency_seconds";
+
+    fprintf(fp, "# HELP %s Time spent per file, by phase.\n", name);
+    fprintf(fp, "# TYPE %s summary\n", name);
+    for (int p = 0; p < METRICS_PHASE_COUNT; p++) {
+        const hist_t *hist = &metrics.latency[p];
+
+        for (size_t q = 0; q < sizeof quantiles / sizeof quantiles[0]; q++) {
+            fprintf(fp, "%s{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                    name, phase_names[p], quantiles[q],
+                    (double)hist_percentile(hist, quantiles[q] * 100.0) / 1e9);
+        }
+        fprintf(fp, "%s_sum{phase=\"%s\"} %.9f\n",
+                name, phase_names[p], (double)hist->sum / 1e9);
+        fprintf(fp, "%s_count{phase=\"%s\"} %" PRIu64 "\n",
+                name, phase_names[p], hist->count);
+    }
+
+    name = "ifstack_file_latency_max_seconds";
+    fprintf(fp, "# HELP %s Maximum time spent on a single file, by phase.\n", name);
+    fprintf(fp, "# TYPE %s gauge\n", name);
+    for (int p = 0; p < METRICS_PHASE_COUNT; p++) {
+        fprintf(fp, "%s{phase=\"%s\"} %.9f\n",
+                name, phase_names[p], (double)metrics.latency[p].max / 1e9);
+    }
+}
+
+
+/** \brief  Get monotonic time in seconds
+ *
+ * \return  time in seconds
+ */
+double metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/** \brief  Record latency of a phase of handling a file
+ *
+ * Not thread-safe, callers from multiple threads must serialize, see
+ * \c metrics_t.
+ *
+ * \param[in]   phase   phase (\c METRICS_PHASE_*)
+ * \param[in]   seconds time spent
+ */
+void metrics_record_latency(int phase, double seconds)
+{
+    hist_record(&metrics.latency[phase],
+                seconds > 0.0 ? (uint64_t)(seconds * 1e9 + 0.5) : 0);
+}
+
+
+/** \brief  Write metrics to file
+ *
+ * Write metrics in the Prometheus text exposition format to \a path. The data
+ * is written to a temporary file first which is then renamed to \a path, so a
+ * scraper (for example the node exporter's textfile collector) never sees a
+ * partially written file.
+ *
+ * \param[in]   path    path to metrics file
+ *
+ * \return  \c false on I/O error
+ */
+bool metrics_write(const char *path)
+{
+    FILE   *fp;
+    char   *tmp;
+    size_t  len = strlen(path) + sizeof ".tmp";
+    bool    result;
+
+    tmp = malloc(len);
+    if (tmp == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, len);
+        exit(1);
+    }
+    snprintf(tmp, len, "%s.tmp", path);
+
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "error: failed to open \"%s\": (%d) %s\n",
+                tmp, errno, strerror(errno));
+        free(tmp);
+        return false;
+    }
+
+    write_metric(fp, "ifstack_files_total", "counter",
+                 "Files parsed.", (double)metrics.files);
+    write_metric(fp, "ifstack_lines_total", "counter",
+                 "Lines of input processed.", (double)metrics.lines);
+    write_metric(fp, "ifstack_bytes_total", "counter",
+                 "Bytes of input processed.", (double)metrics.bytes);
+    write_metric(fp, "ifstack_live_lines_total", "counter",
+                 "Lines passed to the output.", (double)metrics.lines_live);
+    write_metric(fp, "ifstack_directives_total", "counter",
+                 "IF/ELSE/ENDIF statements handled.", (double)metrics.directives);
+    write_metric(fp, "ifstack_errors_total", "counter",
+                 "Files aborted due to an error.", (double)metrics.errors);
+    write_metric(fp, "ifstack_parse_seconds_total", "counter",
+                 "Time spent parsing.", metrics.seconds);
+    write_metric(fp, "ifstack_stack_depth_max", "gauge",
+                 "Maximum if-stack depth seen.", (double)metrics.max_depth);
+    write_latency(fp);
+
+    result = !ferror(fp);
+    if (fclose(fp) != 0) {
+        result = false;
+    }
+    if (result && rename(tmp, path) != 0) {
+        fprintf(stderr, "error: failed to rename \"%s\" to \"%s\": (%d) %s\n",
+                tmp, path, errno, strerror(errno));
+        result = false;
+    }
+    if (!result) {
+        remove(tmp);
+    }
+    free(tmp);
+    return result;
+}
@@ -0,0 +1,67 @@
+/** \file   metrics.h
+ * \brief   Evaluation metrics - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+
+#include "hist.h"
+
+/** \brief  Phases of handling a file, for latency histograms */
+enum {
+    METRICS_PHASE_OPEN,     /**< opening the file */
+    METRICS_PHASE_EVAL,     /**< evaluating (and formatting output) */
+    METRICS_PHASE_WRITE,    /**< flushing output */
+    METRICS_PHASE_TOTAL,    /**< all of the above */
+
+    METRICS_PHASE_COUNT     /**< number of phases */
+};
+
+/** \brief  Evaluation metrics
+ *
+ * Plain counters without locking of their own. The test driver updates them
+ * once per file, after evaluating it, holding its \c stats_lock mutex, so the
+ * worker threads of \c --workers can share them; nothing is updated per line.
+ * metrics_write() is called after the workers have finished.
+ */
+typedef struct metrics_s {
+    unsigned long long files;       /**< files parsed */
+    unsigned long long lines;       /**< lines of input processed */
+    unsigned long long bytes;       /**< bytes of input processed */
+    unsigned long long lines_live;  /**< lines passed to the output */
+    unsigned long long directives;  /**< IF/ELSE/ENDIF statements handled */
+    unsigned long long errors;      /**< files aborted due to an error */
+    unsigned int       max_depth;   /**< maximum if-stack depth seen */
+    double             seconds;     /**< time spent parsing */
+    hist_t             latency[METRICS_PHASE_COUNT];
+                                    /**< per-file latency in nanoseconds */
+} metrics_t;
+
+extern metrics_t metrics;
+
+double metrics_now(void);
+void   metrics_record_latency(int phase, double seconds);
+bool   metrics_write(const char *path);
+
+#endif
@@ -0,0 +1,262 @@
+/** \file   output.c
+ * \brief   Output redirection
+ *
+ * Redirect \c stdout to a file, optionally gzip-compressed.
+ *
+ * Compression runs on its own thread: \c stdout is connected to a pipe, which
+ * the compression thread drains into a gzip stream. The pipe buffer acts as a
+ * bounded queue between the parser and the compressor, so both run
+ * concurrently and uncompressed output never reaches the disk.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "output.h"
+
+
+/** \brief  Size of the buffer used to move data from the pipe to zlib */
+#define OUTPUT_BUFFER_SIZE  65536
+
+
+/** \brief  Gzip stream for compressed output, or \c NULL */
+static gzFile gz;
+
+/** \brief  Read end of the pipe connected to \c stdout */
+static int pipe_fd = -1;
+
+/** \brief  Compression thread */
+static pthread_t compressor;
+
+/** \brief  Compression thread result */
+static bool compressor_ok;
+
+
+/** \brief  Test if \a path has a ".gz" extension
+ *
+ * \param[in]   path    path
+ *
+ * \return  \c true if \a path ends with ".gz"
+ */
+static bool is_gzip_path(const char *path)
+{
+    size_t len = strlen(path);
+
+    return len > 3 && strcmp(path + len - 3, ".gz") == 0;
+}
+
+/** \brief  Compression thread
+ *
+ * Read data from the pipe and write it to the gzip stream until the write end
+ * of the pipe is closed. On error the read end is closed, so writes to
+ * \c stdout fail with \c EPIPE instead of blocking once the pipe is full.
+ *
+ * \param[in]   arg unused
+ *
+ * \return  \c NULL
+ */
+static void *compress_thread(void *arg)
+{
+    static char buffer[OUTPUT_BUFFER_SIZE];
+
+    (void)arg;
+    compressor_ok = true;
+    for (;;) {
+        ssize_t count = read(pipe_fd, buffer, sizeof buffer);
+
+        if (count == 0) {
+            break;
+        } else if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            compressor_ok = false;
+            break;
+        }
+        if (gzwrite(gz, buffer, (unsigned int)count) != (int)count) {
+            compressor_ok = false;
+            break;
+        }
+    }
+    if (!compressor_ok) {
+        close(pipe_fd);
+        pipe_fd = -1;
+    }
+    return NULL;
+}
+
+
+/** \brief  Redirect \c stdout to file
+ *
+ * Redirect \c stdout to \a path. If \a path ends with ".gz" the output is
+ * gzip-compressed on a separate thread. A plain file is also opened for
+ * reading, so the output written can be hashed for the journal.
+ *
+ * \c SIGPIPE is ignored when compressing, so a failing compression thread
+ * shows up as a write error on \c stdout.
+ *
+ * \param[in]   path    path to output file
+ *
+ * \return  \c false on error
+ */
+bool output_open(const char *path)
+{
+    int fds[2];
+
+    if (!is_gzip_path(path)) {
+        if (freopen(path, "w+b", stdout) == NULL) {
+            fprintf(stderr, "error: failed to open \"%s\": (%d) %s\n",
+                    path, errno, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    gz = gzopen(path, "wb");
+    if (gz == NULL) {
+        fprintf(stderr, "error: failed to open \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        return false;
+    }
+    if (pipe(fds) != 0) {
+        fprintf(stderr, "error: failed to create pipe: (%d) %s\n",
+                errno, strerror(errno));
+        gzclose(gz);
+        gz = NULL;
+        return false;
+    }
+
+    /* connect stdout to the write end of the pipe */
+    fflush(stdout);
+    if (dup2(fds[1], STDOUT_FILENO) < 0) {
+        fprintf(stderr, "error: failed to redirect stdout: (%d) %s\n",
+                errno, strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        gzclose(gz);
+        gz = NULL;
+        return false;
+    }
+    close(fds[1]);
+    pipe_fd = fds[0];
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pthread_create(&compressor, NULL, compress_thread, NULL) != 0) {
+        fprintf(stderr, "error: failed to start compression thread\n");
+        close(pipe_fd);
+        pipe_fd = -1;
+        gzclose(gz);
+        gz = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+/** \brief  Redirect \c stdout to file to continue a previous run
+ *
+ * Redirect \c stdout to \a path, keeping the first \a size bytes of the file
+ * and discarding the rest, which is output of a file that didn't complete.
+ * Gzip-compressed output can't be continued.
+ *
+ * \param[in]   path    path to output file
+ * \param[in]   size    size of the output to keep
+ *
+ * \return  \c false on error
+ */
+bool output_resume(const char *path, uint64_t size)
+{
+    struct stat st;
+
+    if (size == 0) {
+        return output_open(path);
+    }
+    if (is_gzip_path(path)) {
+        fprintf(stderr, "error: can't continue gzip-compressed output \"%s\"\n", path);
+        return false;
+    }
+    if (freopen(path, "r+b", stdout) == NULL || fstat(STDOUT_FILENO, &st) != 0) {
+        fprintf(stderr, "error: failed to open \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        return false;
+    }
+    if ((uint64_t)st.st_size < size) {
+        fprintf(stderr, "error: \"%s\" is shorter than recorded in the journal\n", path);
+        return false;
+    }
+    if (ftruncate(STDOUT_FILENO, (off_t)size) != 0
+            || fseeko(stdout, (off_t)size, SEEK_SET) != 0) {
+        fprintf(stderr, "error: failed to truncate \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+/** \brief  Flush and close output
+ *
+ * Flush \c stdout and, when compressing, wait for the compression thread to
+ * finish and close the gzip stream.
+ *
+ * \return  \c false on I/O error
+ */
+bool output_close(void)
+{
+    bool result = true;
+
+    if (fflush(stdout) != 0) {
+        result = false;
+    }
+    if (gz != NULL) {
+        /* closing the write end signals end of data to the compressor */
+        close(STDOUT_FILENO);
+        pthread_join(compressor, NULL);
+        if (pipe_fd >= 0) {
+            close(pipe_fd);
+            pipe_fd = -1;
+        }
+        if (!compressor_ok) {
+            int errnum;
+
+            fprintf(stderr, "error: failed to compress output: %s\n", gzerror(gz, &errnum));
+            result = false;
+        }
+        if (gzclose(gz) != Z_OK) {
+            result = false;
+        }
+        gz = NULL;
+    }
+    if (!result) {
+        fprintf(stderr, "error: failed to write output\n");
+    }
+    return result;
+}
@@ -0,0 +1,194 @@
+/** \file   perfctr.c
+ * \brief   Hardware performance counters
+ *
+ * Thin wrapper around Linux' \c perf_event_open(2) to count cycles,
+ * instructions, branch misses and cache misses for the benchmarks.
+ *
+ * Counters that can't be opened (no PMU, restricted by
+ * \c /proc/sys/kernel/perf_event_paranoid, non-Linux) are marked unavailable
+ * and simply not reported.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perfctr.h"
+
+
+#ifdef __linux__
+
+/** \brief  Event type and config of each counter */
+static const struct {
+    uint32_t type;      /**< event type */
+    uint64_t config;    /**< event config */
+} events[PERFCTR_COUNT] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                          (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES }
+};
+
+#endif
+
+
+/** \brief  Open performance counters
+ *
+ * Open counters for process \a pid, or for the calling thread when \a pid is
+ * 0. Counters for the calling thread are started with perfctr_start(),
+ * counters for another process start counting when that process calls
+ * \c exec(), which allows measuring a child process from \c fork() onward
+ * without counting the \c fork() itself.
+ *
+ * \param[out]  ctr counters
+ * \param[in]   pid process ID or 0
+ */
+void perfctr_open(perfctr_t *ctr, pid_t pid)
+{
+    for (int i = 0; i < PERFCTR_COUNT; i++) {
+        ctr->fd[i]    = -1;
+        ctr->value[i] = 0;
+#ifdef __linux__
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof attr);
+        attr.size           = sizeof attr;
+        attr.type           = events[i].type;
+        attr.config         = events[i].config;
+        attr.disabled       = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        attr.inherit        = 1;
+        attr.enable_on_exec = pid != 0;
+        attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                              PERF_FORMAT_TOTAL_TIME_RUNNING;
+        ctr->fd[i] = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+#else
+        (void)pid;
+#endif
+    }
+}
+
+
+/** \brief  Reset and start counters of the calling thread
+ *
+ * \param[in,out]   ctr counters
+ */
+void perfctr_start(perfctr_t *ctr)
+{
+#ifdef __linux__
+    for (int i = 0; i < PERFCTR_COUNT; i++) {
+        if (ctr->fd[i] >= 0) {
+            ioctl(ctr->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(ctr->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    (void)ctr;
+#endif
+}
+
+
+/** \brief  Stop counters of the calling thread
+ *
+ * \param[in,out]   ctr counters
+ */
+void perfctr_stop(perfctr_t *ctr)
+{
+#ifdef __linux__
+    for (int i = 0; i < PERFCTR_COUNT; i++) {
+        if (ctr->fd[i] >= 0) {
+            ioctl(ctr->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#else
+    (void)ctr;
+#endif
+}
+
+
+/** \brief  Read counter values
+ *
+ * Values are scaled when the kernel had to multiplex the counters. Counters
+ * that fail to read or never ran are marked unavailable.
+ *
+ * \param[in,out]   ctr counters
+ */
+void perfctr_read(perfctr_t *ctr)
+{
+    for (int i = 0; i < PERFCTR_COUNT; i++) {
+        uint64_t data[3];   /* value, time enabled, time running */
+
+        if (ctr->fd[i] < 0) {
+            continue;
+        }
+        if (read(ctr->fd[i], data, sizeof data) != (ssize_t)sizeof data ||
+                data[2] == 0) {
+            close(ctr->fd[i]);
+            ctr->fd[i] = -1;
+            continue;
+        }
+        if (data[2] < data[1]) {
+            data[0] = (uint64_t)((double)data[0] * (double)data[1] / (double)data[2]);
+        }
+        ctr->value[i] = data[0];
+    }
+}
+
+
+/** \brief  Close counters
+ *
+ * \param[in,out]   ctr counters
+ */
+void perfctr_close(perfctr_t *ctr)
+{
+    for (int i = 0; i < PERFCTR_COUNT; i++) {
+        if (ctr->fd[i] >= 0) {
+            close(ctr->fd[i]);
+            ctr->fd[i] = -1;
+        }
+    }
+}
+
+
+/** \brief  Test if counter is available
+ *
+ * \param[in]   ctr     counters
+ * \param[in]   index   counter index
+ *
+ * \return  \c true if counter \a index could be opened and read
+ */
+bool perfctr_valid(const perfctr_t *ctr, int index)
+{
+    return ctr->fd[index] >= 0;
+}
@@ -0,0 +1,57 @@
+/** \file   perfctr.h
+ * \brief   Hardware performance counters - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** \brief  Counter indexes */
+enum {
+    PERFCTR_CYCLES,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_BRANCH_MISSES,
+    PERFCTR_L1D_MISSES,
+    PERFCTR_LLC_MISSES,
+
+    PERFCTR_COUNT   /**< number of counters */
+};
+
+/** \brief  Set of performance counters
+ */
+typedef struct perfctr_s {
+    int      fd[PERFCTR_COUNT];     /**< counter file descriptors, -1 when
+                                         the counter is unavailable */
+    uint64_t value[PERFCTR_COUNT];  /**< counter values after perfctr_read() */
+} perfctr_t;
+
+void perfctr_open(perfctr_t *ctr, pid_t pid);
+void perfctr_start(perfctr_t *ctr);
+void perfctr_stop(perfctr_t *ctr);
+void perfctr_read(perfctr_t *ctr);
+void perfctr_close(perfctr_t *ctr);
+bool perfctr_valid(const perfctr_t *ctr, int index);
+
+#endif
@@ -0,0 +1,420 @@
+/** \file   profile.c
+ * \brief   Per-condition profile
+ *
+ * Attributes evaluation to the conditions of the input: for each branch of
+ * each condition, keyed by its text (for example "if FEATURE", "if FEATURE /
+ * else" or "switch OS / case linux"), the number of times the branch was
+ * entered, the lines and bytes of text directly inside it that were live or
+ * dead, and the time spent inside it, including nested branches. Text outside
+ * any condition is attributed to "(top level)".
+ *
+ * Branches with the same text in different files, or in different places of
+ * a file, are aggregated.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include "metrics.h"
+#include "symbols.h"
+#include "profile.h"
+
+
+/** \brief  Key of text outside any condition */
+#define PROFILE_TOP_LEVEL   "(top level)"
+
+
+/** \brief  Profile entry of a branch
+ */
+typedef struct entry_s {
+    char     *key;          /**< condition text */
+    size_t    key_len;      /**< length of \c key */
+    uint32_t  hash;         /**< hash of \c key */
+    uint64_t  evaluations;  /**< number of times the branch was entered */
+    uint64_t  live_lines;   /**< live lines of text in the branch */
+    uint64_t  live_bytes;   /**< live bytes of text in the branch */
+    uint64_t  dead_lines;   /**< dead lines of text in the branch */
+    uint64_t  dead_bytes;   /**< dead bytes of text in the branch */
+    double    seconds;      /**< time spent in the branch */
+} entry_t;
+
+/** \brief  Open condition
+ */
+typedef struct frame_s {
+    size_t base;    /**< entry of the IF or SWITCH */
+    size_t entry;   /**< entry of the current branch */
+    double start;   /**< start time of the current branch */
+} frame_t;
+
+
+/** \brief  Profile entries */
+static entry_t *entries;
+
+/** \brief  Number of entries allocated in \c entries */
+static size_t entries_size;
+
+/** \brief  Number of entries in \c entries */
+static size_t entries_count;
+
+/** \brief  Hash index of \c entries by key, entry index + 1, 0 for empty */
+static size_t *index_slots;
+
+/** \brief  Number of slots in \c index_slots, a power of 2 */
+static size_t index_size;
+
+/** \brief  Stack of open conditions */
+static frame_t *frames;
+
+/** \brief  Number of frames allocated in \c frames */
+static size_t frames_size;
+
+/** \brief  Number of open conditions */
+static size_t frames_count;
+
+/** \brief  Buffer for building keys */
+static char *key_buffer;
+
+/** \brief  Size of \c key_buffer */
+static size_t key_size;
+
+
+/** \brief  Resize memory block
+ *
+ * \param[in]   ptr     memory block
+ * \param[in]   size    new size
+ *
+ * \return  resized memory block
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void *profile_realloc(void *ptr, size_t size)
+{
+    void *tmp = realloc(ptr, size);
+
+    if (tmp == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, size);
+        exit(1);
+    }
+    return tmp;
+}
+
+/** \brief  Find index slot for key
+ *
+ * \param[in]   key     key
+ * \param[in]   len     length of \a key
+ * \param[in]   hash    hash of \a key
+ *
+ * \return  slot containing the entry for \a key, or the empty slot where it
+ *          belongs
+ */
+static size_t *index_find(const char *key, size_t len, uint32_t hash)
+{
+    size_t mask = index_size - 1;
+    size_t i    = hash & mask;
+
+    while (index_slots[i] != 0) {
+        const entry_t *e = &entries[index_slots[i] - 1];
+
+        if (e->hash == hash && e->key_len == len && memcmp(e->key, key, len) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &index_slots[i];
+}
+
+/** \brief  Get entry for key, creating it if required
+ *
+ * \param[in]   key     key
+ * \param[in]   len     length of \a key
+ *
+ * \return  index of entry
+ */
+static size_t entry_get(const char *key, size_t len)
+{
+    uint32_t  hash = symbols_hash(key, len);
+    size_t   *slot;
+    entry_t  *e;
+
+    if ((entries_count + 1) * 2 > index_size) {
+        free(index_slots);
+        index_size  = index_size > 0 ? index_size * 2 : 256;
+        index_slots = profile_realloc(NULL, index_size * sizeof *index_slots);
+        memset(index_slots, 0, index_size * sizeof *index_slots);
+        for (size_t i = 0; i < entries_count; i++) {
+            e = &entries[i];
+            *index_find(e->key, e->key_len, e->hash) = i + 1;
+        }
+    }
+
+    slot = index_find(key, len, hash);
+    if (*slot != 0) {
+        return *slot - 1;
+    }
+
+    if (entries_count == entries_size) {
+        entries_size = entries_size > 0 ? entries_size * 2 : 256;
+        entries      = profile_realloc(entries, entries_size * sizeof *entries);
+    }
+    e = &entries[entries_count];
+    memset(e, 0, sizeof *e);
+    e->key = profile_realloc(NULL, len + 1);
+    memcpy(e->key, key, len);
+    e->key[len] = '\0';
+    e->key_len  = len;
+    e->hash     = hash;
+    *slot       = ++entries_count;
+    return entries_count - 1;
+}
+
+/** \brief  Build key in \c key_buffer
+ *
+ * The key is "<prefix> / <directive> <arg>" or "<directive> <arg>" without
+ * prefix, the argument is left out when \a arg is \c NULL.
+ *
+ * \param[in]   prefix      key of the enclosing IF or SWITCH, or \c NULL
+ * \param[in]   directive   directive
+ * \param[in]   arg         argument of directive, or \c NULL
+ * \param[in]   len         length of \a arg
+ *
+ * \return  length of key
+ */
+static size_t key_build(const char *prefix, const char *directive, const char *arg, size_t len)
+{
+    size_t prefix_len    = prefix != NULL ? strlen(prefix) : 0;
+    size_t directive_len = strlen(directive);
+    size_t need          = prefix_len + 3 + directive_len + 1 + len;
+    size_t pos           = 0;
+
+    if (need > key_size) {
+        key_size   = need * 2;
+        key_buffer = profile_realloc(key_buffer, key_size);
+    }
+    if (prefix != NULL) {
+        memcpy(key_buffer, prefix, prefix_len);
+        memcpy(key_buffer + prefix_len, " / ", 3);
+        pos = prefix_len + 3;
+    }
+    memcpy(key_buffer + pos, directive, directive_len);
+    pos += directive_len;
+    if (arg != NULL) {
+        key_buffer[pos++] = ' ';
+        memcpy(key_buffer + pos, arg, len);
+        pos += len;
+    }
+    return pos;
+}
+
+/** \brief  Compare entries by dead bytes, descending, for \c qsort()
+ *
+ * \param[in]   p1  first entry
+ * \param[in]   p2  second entry
+ *
+ * \return  <0, 0 or >0
+ */
+static int entry_compare(const void *p1, const void *p2)
+{
+    const entry_t *e1 = p1;
+    const entry_t *e2 = p2;
+
+    if (e1->dead_bytes != e2->dead_bytes) {
+        return e1->dead_bytes < e2->dead_bytes ? 1 : -1;
+    }
+    return strcmp(e1->key, e2->key);
+}
+
+
+/** \brief  Enter IF or SWITCH
+ *
+ * \param[in]   directive   directive
+ * \param[in]   arg         condition text
+ * \param[in]   len         length of \a arg
+ */
+void profile_enter(const char *directive, const char *arg, size_t len)
+{
+    frame_t *frame;
+    size_t   len_key = key_build(NULL, directive, arg, len);
+    size_t   entry   = entry_get(key_buffer, len_key);
+
+    if (frames_count == frames_size) {
+        frames_size = frames_size > 0 ? frames_size * 2 : 64;
+        frames      = profile_realloc(frames, frames_size * sizeof *frames);
+    }
+    frame        = &frames[frames_count++];
+    frame->base  = entry;
+    frame->entry = entry;
+    frame->start = metrics_now();
+    entries[entry].evaluations++;
+}
+
+
+/** \brief  Enter next branch of the innermost IF or SWITCH
+ *
+ * \param[in]   directive   directive (ELSE, CASE or DEFAULT)
+ * \param[in]   arg         argument of directive, or \c NULL
+ * \param[in]   len         length of \a arg
+ */
+void profile_branch(const char *directive, const char *arg, size_t len)
+{
+    frame_t *frame;
+    double   now;
+    size_t   len_key;
+
+    if (frames_count == 0) {
+        return;
+    }
+    frame   = &frames[frames_count - 1];
+    len_key = key_build(entries[frame->base].key, directive, arg, len);
+    now     = metrics_now();
+
+    entries[frame->entry].seconds += now - frame->start;
+    frame->entry = entry_get(key_buffer, len_key);
+    frame->start = now;
+    entries[frame->entry].evaluations++;
+}
+
+
+/** \brief  Leave innermost IF or SWITCH
+ */
+void profile_leave(void)
+{
+    frame_t *frame;
+
+    if (frames_count == 0) {
+        return;
+    }
+    frame = &frames[--frames_count];
+    entries[frame->entry].seconds += metrics_now() - frame->start;
+}
+
+
+/** \brief  Attribute line of text to the current branch
+ *
+ * \param[in]   live    line is live
+ * \param[in]   bytes   size of line, including line ending
+ */
+void profile_text(bool live, uint64_t bytes)
+{
+    entry_t *e;
+    size_t   entry;
+
+    if (frames_count > 0) {
+        entry = frames[frames_count - 1].entry;
+    } else {
+        entry = entry_get(PROFILE_TOP_LEVEL, strlen(PROFILE_TOP_LEVEL));
+    }
+    e = &entries[entry];
+    if (live) {
+        e->live_lines++;
+        e->live_bytes += bytes;
+    } else {
+        e->dead_lines++;
+        e->dead_bytes += bytes;
+    }
+}
+
+
+/** \brief  Leave conditions left open at the end of a file
+ */
+void profile_end_file(void)
+{
+    while (frames_count > 0) {
+        profile_leave();
+    }
+}
+
+
+/** \brief  Write profile report
+ *
+ * Writes a table of the branches, sorted by dead bytes, descending.
+ *
+ * \param[in]   path    path to report
+ *
+ * \return  \c false on error
+ */
+bool profile_write(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    bool  ok;
+
+    if (fp == NULL) {
+        fprintf(stderr, "error: failed to open \"%s\": (%d) %s\n",
+                path, errno, strerror(errno));
+        return false;
+    }
+
+    /* the index isn't needed anymore */
+    qsort(entries, entries_count, sizeof *entries, entry_compare);
+    free(index_slots);
+    index_slots = NULL;
+    index_size  = 0;
+
+    fprintf(fp, "%12s  %12s  %14s  %12s  %14s  %12s  %s\n",
+            "evaluations", "live lines", "live bytes", "dead lines", "dead bytes",
+            "seconds", "condition");
+    for (size_t i = 0; i < entries_count; i++) {
+        const entry_t *e = &entries[i];
+
+        fprintf(fp, "%12" PRIu64 "  %12" PRIu64 "  %14" PRIu64 "  %12" PRIu64 "  %14" PRIu64
+                "  %12.6f  %s\n",
+                e->evaluations, e->live_lines, e->live_bytes, e->dead_lines, e->dead_bytes,
+                e->seconds, e->key);
+    }
+
+    ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "error: failed to write \"%s\"\n", path);
+    }
+    return ok;
+}
+
+
+/** \brief  Free the profile
+ */
+void profile_free(void)
+{
+    for (size_t i = 0; i < entries_count; i++) {
+        free(entries[i].key);
+    }
+    free(entries);
+    free(index_slots);
+    free(frames);
+    free(key_buffer);
+    entries       = NULL;
+    entries_size  = 0;
+    entries_count = 0;
+    index_slots   = NULL;
+    index_size    = 0;
+    frames        = NULL;
+    frames_size   = 0;
+    frames_count  = 0;
+    key_buffer    = NULL;
+    key_size      = 0;
+}
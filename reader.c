@@ -0,0 +1,313 @@
+/** \file   reader.c
+ * \brief   Line reader
+ *
+ * Block-based line reader: the input is read in large blocks and split into
+ * lines in place, lines are only limited in length by available memory.
+ *
+ * A leading UTF-8 byte order mark is skipped, and both LF and CRLF line endings
+ * are accepted. Optionally each line is validated as UTF-8.
+ *
+ * The path "-" reads standard input. Since \c read(2) returns whatever is
+ * available on a pipe or terminal, lines are returned as soon as they are
+ * complete, and memory use is bounded by the longest line.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "scan.h"
+#include "reader.h"
+
+
+/** \brief  Initial size of the block buffer */
+#define READER_BLOCK_SIZE   65536
+
+/** \brief  UTF-8 byte order mark */
+#define UTF8_BOM            "\xef\xbb\xbf"
+
+
+/** \brief  Resize block buffer
+ *
+ * \param[in,out]   reader  reader
+ * \param[in]       size    new size of buffer
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void reader_resize(reader_t *reader, size_t size)
+{
+    char *buffer = realloc(reader->buffer, size);
+
+    if (buffer == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, size);
+        exit(1);
+    }
+    reader->buffer = buffer;
+    reader->size   = size;
+}
+
+/** \brief  Read next block of data from file
+ *
+ * Move unprocessed data to the start of the buffer and fill the remainder of
+ * the buffer with data from the file, growing the buffer if it's full.
+ *
+ * Reads at most \c reader->remain bytes. When set, \c reader->wait is called
+ * before reading, with \c true if the read would block.
+ *
+ * \param[in,out]   reader  reader
+ *
+ * \return  \c false on I/O error
+ */
+static bool reader_fill(reader_t *reader)
+{
+    size_t  avail = reader->len - reader->pos;
+    size_t  want;
+    ssize_t count;
+
+    if (reader->pos > 0) {
+        memmove(reader->buffer, reader->buffer + reader->pos, avail);
+        reader->offset += reader->pos;
+        reader->len     = avail;
+        reader->pos     = 0;
+    }
+    /* keep one byte free for the terminating nul */
+    if (reader->len + 1 >= reader->size) {
+        reader_resize(reader, reader->size * 2);
+    }
+
+    want = reader->size - reader->len - 1;
+    if (want > reader->remain) {
+        want = (size_t)reader->remain;
+    }
+    if (want == 0) {
+        count = 0;
+    } else {
+        if (reader->wait != NULL) {
+            struct pollfd pfd = { .fd = reader->fd, .events = POLLIN };
+
+            reader->wait(poll(&pfd, 1, 0) == 0);
+        }
+        do {
+            count = read(reader->fd, reader->buffer + reader->len, want);
+        } while (count < 0 && errno == EINTR);
+    }
+    if (count < 0) {
+        reader->error = READER_ERR_IO;
+        return false;
+    } else if (count == 0) {
+        reader->eof = true;
+    }
+    reader->len    += (size_t)count;
+    reader->remain -= (uint64_t)count;
+    return true;
+}
+
+
+/** \brief  Initialize reader
+ *
+ * \param[out]  reader  reader
+ */
+void reader_init(reader_t *reader)
+{
+    reader->fd     = -1;
+    reader->buffer = NULL;
+    reader->size   = 0;
+    reader->wait   = NULL;
+}
+
+
+/** \brief  Start reading from file descriptor
+ *
+ * The block buffer is allocated on first use and reused for later files.
+ *
+ * \param[in,out]   reader      reader
+ * \param[in]       fd          file descriptor
+ * \param[in]       size        number of bytes to read from \a fd, or
+ *                              \c UINT64_MAX to read until end of file
+ * \param[in]       check_utf8  validate lines as UTF-8
+ * \param[in]       close_fd    close \a fd in reader_close()
+ */
+static void reader_start(reader_t *reader, int fd, uint64_t size, bool check_utf8, bool close_fd)
+{
+    if (reader->buffer == NULL) {
+        reader_resize(reader, READER_BLOCK_SIZE);
+    }
+    reader->fd           = fd;
+    reader->close_fd     = close_fd;
+    reader->remain       = size;
+    reader->pos          = 0;
+    reader->len          = 0;
+    reader->offset       = 0;
+    reader->eof          = false;
+    reader->check_utf8   = check_utf8;
+    reader->error        = READER_ERR_OK;
+    reader->error_offset = 0;
+
+    /* skip byte order mark */
+    if (reader_fill(reader) &&
+            reader->len >= sizeof UTF8_BOM - 1 &&
+            memcmp(reader->buffer, UTF8_BOM, sizeof UTF8_BOM - 1) == 0) {
+        reader->pos = sizeof UTF8_BOM - 1;
+    }
+}
+
+
+/** \brief  Open file for reading
+ *
+ * \param[in,out]   reader      reader
+ * \param[in]       path        path to file, "-" for standard input
+ * \param[in]       check_utf8  validate lines as UTF-8
+ *
+ * \return  \c false if \a path couldn't be opened (see \c errno)
+ */
+bool reader_open(reader_t *reader, const char *path, bool check_utf8)
+{
+    int fd;
+
+    if (strcmp(path, "-") == 0) {
+        reader_start(reader, STDIN_FILENO, UINT64_MAX, check_utf8, false);
+        return true;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    reader_start(reader, fd, UINT64_MAX, check_utf8, true);
+    return true;
+}
+
+
+/** \brief  Read part of an open file
+ *
+ * Reads the next \a size bytes of \a fd as a file of their own, for example a
+ * member of an archive. \a fd is left open by reader_close(), the number of
+ * bytes not read from it is left in \c reader->remain.
+ *
+ * \param[in,out]   reader      reader
+ * \param[in]       fd          file descriptor
+ * \param[in]       size        number of bytes to read
+ * \param[in]       check_utf8  validate lines as UTF-8
+ */
+void reader_open_fd(reader_t *reader, int fd, uint64_t size, bool check_utf8)
+{
+    reader_start(reader, fd, size, check_utf8, false);
+}
+
+
+/** \brief  Close file
+ *
+ * The block buffer is kept for reuse, use reader_free() to free it. Standard
+ * input and descriptors passed to reader_open_fd() are left open.
+ *
+ * \param[in,out]   reader  reader
+ */
+void reader_close(reader_t *reader)
+{
+    if (reader->close_fd) {
+        close(reader->fd);
+    }
+    reader->fd = -1;
+}
+
+
+/** \brief  Free reader's block buffer
+ *
+ * \param[in,out]   reader  reader
+ */
+void reader_free(reader_t *reader)
+{
+    free(reader->buffer);
+    reader->buffer = NULL;
+    reader->size   = 0;
+}
+
+
+/** \brief  Get next line
+ *
+ * Get the next line from \a reader, with the line ending (LF or CRLF) removed.
+ * The line is nul-terminated and valid until the next call.
+ *
+ * \param[in,out]   reader  reader
+ * \param[out]      len     length of line, excluding the line ending
+ *
+ * \return  line or \c NULL on end of file or error (see \c reader->error)
+ */
+char *reader_getline(reader_t *reader, size_t *len)
+{
+    char   *line;
+    char   *nl;
+    size_t  scanned = 0;
+    size_t  n;
+
+    if (reader->error != READER_ERR_OK) {
+        return NULL;
+    }
+
+    /* find end of line, reading more data if required */
+    while ((nl = memchr(reader->buffer + reader->pos + scanned, '\n',
+                        reader->len - reader->pos - scanned)) == NULL) {
+        if (reader->eof) {
+            break;
+        }
+        scanned = reader->len - reader->pos;
+        if (!reader_fill(reader)) {
+            return NULL;
+        }
+    }
+
+    line = reader->buffer + reader->pos;
+    if (nl != NULL) {
+        n = (size_t)(nl - line);
+        reader->pos += n + 1;
+    } else {
+        /* last line without line ending */
+        n = reader->len - reader->pos;
+        if (n == 0) {
+            return NULL;
+        }
+        reader->pos += n;
+    }
+    if (n > 0 && line[n - 1] == '\r') {
+        n--;
+    }
+    line[n] = '\0';
+
+    if (reader->check_utf8) {
+        size_t valid = scan_utf8(line, n);
+
+        if (valid < n) {
+            reader->error        = READER_ERR_UTF8;
+            reader->error_offset = reader->offset + (uint64_t)(line - reader->buffer) + valid;
+            return NULL;
+        }
+    }
+
+    *len = n;
+    return line;
+}
@@ -0,0 +1,68 @@
+/** \file   reader.h
+ * \brief   Line reader - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    READER_ERR_OK,
+    READER_ERR_IO,
+    READER_ERR_UTF8
+};
+
+/** \brief  Line reader
+ *
+ * Reads a file in large blocks and splits it into lines. The block buffer is
+ * kept when the file is closed, so a reader can be used for any number of
+ * files without allocating memory again.
+ */
+typedef struct reader_s {
+    int       fd;           /**< file descriptor of file being read */
+    char     *buffer;       /**< block buffer */
+    size_t    size;         /**< size of \c buffer */
+    size_t    pos;          /**< start of unprocessed data in \c buffer */
+    size_t    len;          /**< number of valid bytes in \c buffer */
+    uint64_t  offset;       /**< file offset of \c buffer[0] */
+    bool      eof;          /**< end of file reached */
+    bool      check_utf8;   /**< validate input as UTF-8 */
+    int       error;        /**< error code */
+    uint64_t  error_offset; /**< file offset of invalid UTF-8 sequence */
+    uint64_t  remain;       /**< number of bytes left to read from \c fd */
+    bool      close_fd;     /**< close \c fd when closing the reader */
+
+    /** \brief  Called before each read, \a block is \c true if it would block */
+    void (*wait)(bool block);
+} reader_t;
+
+void  reader_init(reader_t *reader);
+bool  reader_open(reader_t *reader, const char *path, bool check_utf8);
+void  reader_open_fd(reader_t *reader, int fd, uint64_t size, bool check_utf8);
+void  reader_close(reader_t *reader);
+void  reader_free(reader_t *reader);
+char *reader_getline(reader_t *reader, size_t *len);
+
+#endif
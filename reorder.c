@@ -0,0 +1,278 @@
+/** \file   reorder.c
+ * \brief   Bounded reorder buffer
+ *
+ * Puts the outputs of files evaluated in parallel back in input order. Each
+ * file gets a sequence number when it's handed to a worker; workers put the
+ * output of a file in the buffer when they're done with it, in any order, and
+ * the writer takes the outputs out in sequence.
+ *
+ * Outputs that arrive before their turn are held in memory as long as the
+ * outputs held in total fit in the cap. Beyond the cap they are spilled to
+ * temporary files and read back when it's their turn, so memory use doesn't
+ * depend on how far the workers get ahead of a slow file. The next output in
+ * turn is never spilled. An output kept in memory is counted against the cap
+ * in the same step as deciding to keep it, so outputs put at the same time
+ * can't together go over it.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "reorder.h"
+
+
+/** \brief  Size of the buffer for copying spilled outputs */
+#define REORDER_COPY_SIZE   65536
+
+
+/** \brief  Output held in the buffer
+ */
+typedef struct item_s {
+    struct item_s *next;    /**< next item, by sequence number */
+    uint64_t       seq;     /**< sequence number */
+    char          *data;    /**< output in memory, \c NULL when spilled */
+    size_t         len;     /**< length of the output */
+    FILE          *spill;   /**< temporary file with the output, or \c NULL */
+    void          *tag;     /**< caller's data */
+} item_t;
+
+
+/** \brief  Lock protecting the buffer */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** \brief  Signalled when an output is put in the buffer */
+static pthread_cond_t put_cond = PTHREAD_COND_INITIALIZER;
+
+/** \brief  Outputs held, by sequence number */
+static item_t *held;
+
+/** \brief  Sequence number of the output to take next */
+static uint64_t next_seq;
+
+/** \brief  Number of bytes of output held in memory */
+static size_t held_bytes;
+
+/** \brief  Maximum number of bytes of output held in memory before spilling */
+static size_t held_cap;
+
+/** \brief  Output taken by reorder_take(), to be written by reorder_write() */
+static item_t *taken;
+
+
+/** \brief  Spill output to a temporary file
+ *
+ * Called without the lock held. When the temporary file can't be written
+ * the output is kept in memory.
+ *
+ * \param[in,out]   item    item with its output in memory
+ */
+static void item_spill(item_t *item)
+{
+    FILE *fp = tmpfile();
+
+    if (fp == NULL || fwrite(item->data, 1, item->len, fp) != item->len || fflush(fp) != 0) {
+        fprintf(stderr, "warning: failed to spill output to a temporary file: (%d) %s\n",
+                errno, strerror(errno));
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return;
+    }
+    free(item->data);
+    item->data  = NULL;
+    item->spill = fp;
+}
+
+
+/** \brief  Open the reorder buffer
+ *
+ * \param[in]   cap maximum number of bytes of output to hold in memory
+ */
+void reorder_open(size_t cap)
+{
+    held       = NULL;
+    next_seq   = 0;
+    held_bytes = 0;
+    held_cap   = cap;
+    taken      = NULL;
+}
+
+
+/** \brief  Put output in the buffer
+ *
+ * Called by a worker when it's done with a file. The output is spilled to a
+ * temporary file if it doesn't fit in the cap and it's not its turn yet.
+ * An output kept in memory reserves its size in the cap when deciding; an
+ * output that can't be spilled is kept in memory anyway, over the cap.
+ *
+ * \param[in]   seq     sequence number of the file, each number in order
+ *                      from 0 must be put once
+ * \param[in]   data    output, freed by the buffer, or \c NULL if \a len is 0
+ * \param[in]   len     length of \a data
+ * \param[in]   tag     caller's data returned by reorder_take(), not \c NULL
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+void reorder_put(uint64_t seq, char *data, size_t len, void *tag)
+{
+    item_t  *item = malloc(sizeof *item);
+    item_t **link;
+    bool     spill;
+
+    if (item == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, sizeof *item);
+        exit(1);
+    }
+    item->seq   = seq;
+    item->data  = data;
+    item->len   = len;
+    item->spill = NULL;
+    item->tag   = tag;
+
+    /* decide and reserve at once, so concurrent puts can't overshoot */
+    pthread_mutex_lock(&lock);
+    spill = seq != next_seq && len > 0 && held_bytes + len > held_cap;
+    if (!spill) {
+        held_bytes += len;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (spill) {
+        item_spill(item);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (spill && item->data != NULL) {
+        /* spilling failed */
+        held_bytes += len;
+    }
+    for (link = &held; *link != NULL && (*link)->seq < seq; link = &(*link)->next) {
+        /* outputs arrive close to their order, so the list is short */
+    }
+    item->next = *link;
+    *link      = item;
+    pthread_cond_signal(&put_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/** \brief  Take the next output from the buffer
+ *
+ * The output is written with reorder_write(), which must be called before
+ * taking the next output.
+ *
+ * \param[in]   wait    wait until the next output has been put
+ *
+ * \return  tag of the next output, or \c NULL if it hasn't been put and
+ *          \a wait is \c false
+ */
+void *reorder_take(bool wait)
+{
+    void *tag = NULL;
+
+    pthread_mutex_lock(&lock);
+    while (wait && (held == NULL || held->seq != next_seq)) {
+        pthread_cond_wait(&put_cond, &lock);
+    }
+    if (held != NULL && held->seq == next_seq) {
+        taken = held;
+        held  = taken->next;
+        if (taken->data != NULL) {
+            held_bytes -= taken->len;
+        }
+        next_seq++;
+        tag = taken->tag;
+    }
+    pthread_mutex_unlock(&lock);
+    return tag;
+}
+
+
+/** \brief  Write the output taken and free it
+ *
+ * \param[in]   fp  stream to write to, or \c NULL to discard the output
+ *
+ * \return  \c false on I/O error
+ */
+bool reorder_write(FILE *fp)
+{
+    item_t *item = taken;
+    bool    ok   = true;
+
+    taken = NULL;
+    if (item == NULL) {
+        return true;
+    }
+    if (fp == NULL) {
+        if (item->spill != NULL) {
+            fclose(item->spill);
+        }
+    } else if (item->spill != NULL) {
+        char   buffer[REORDER_COPY_SIZE];
+        size_t n;
+
+        rewind(item->spill);
+        while ((n = fread(buffer, 1, sizeof buffer, item->spill)) > 0) {
+            if (fwrite(buffer, 1, n, fp) != n) {
+                ok = false;
+                break;
+            }
+        }
+        if (ferror(item->spill)) {
+            ok = false;
+        }
+        fclose(item->spill);
+    } else if (item->len > 0 && fwrite(item->data, 1, item->len, fp) != item->len) {
+        ok = false;
+    }
+    free(item->data);
+    free(item);
+    return ok;
+}
+
+
+/** \brief  Close the reorder buffer
+ *
+ * Discards outputs not taken, their tags are not freed.
+ */
+void reorder_close(void)
+{
+    while (held != NULL) {
+        item_t *next = held->next;
+
+        if (held->spill != NULL) {
+            fclose(held->spill);
+        }
+        free(held->data);
+        free(held);
+        held = next;
+    }
+    taken      = NULL;
+    held_bytes = 0;
+}
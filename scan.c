@@ -0,0 +1,698 @@
+/** \file   scan.c
+ * \brief   Byte scanning kernels
+ *
+ * Scanning loops used by the input reader and the search mode of the test
+ * driver, and a newline counter for splitting input into chunks of lines.
+ * The kernels of these loops have a portable word-at-a-time (SWAR) version
+ * and, on x86, SSE2 and AVX2 versions. scan_init() selects the best version
+ * the CPU supports, until then the portable version is used.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "scan.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+/** \brief  Build the SSE2 and AVX2 kernels */
+# define SCAN_X86
+# include <immintrin.h>
+#endif
+
+
+/** \brief  Mask with the high bit of each byte in a word set */
+#define HIGH_BITS   0x8080808080808080ULL
+
+/** \brief  Mask with the low bit of each byte in a word set */
+#define LOW_BITS    0x0101010101010101ULL
+
+/** \brief  Mask with the low seven bits of each byte in a word set */
+#define LOW7_BITS   0x7f7f7f7f7f7f7f7fULL
+
+/** \brief  Set the high bit of each byte in \a v that may be zero
+ *
+ * Each zero byte in \a v is flagged, bytes above a zero byte can be flagged
+ * falsely due to borrows, so candidates must be verified.
+ *
+ * \param[in]   v   word
+ */
+#define ZERO_BYTES(v)   (((v) - LOW_BITS) & ~(v) & HIGH_BITS)
+
+
+/** \brief  Kernels of a CPU level
+ */
+typedef struct level_s {
+    const char *name;       /**< name of the level */
+    const char *feature;    /**< CPU feature required, or \c NULL */
+
+    /** \brief  Get length of ASCII prefix of \a s, at most \a len */
+    size_t (*ascii)(const unsigned char *s, size_t len);
+
+    /** \brief  Find \a p of length \a plen, with 0 < \a plen <= \a len */
+    size_t (*find)(const unsigned char *s, size_t len, const unsigned char *p, size_t plen);
+
+    /** \brief  Count the newlines in \a s */
+    uint64_t (*lines)(const unsigned char *s, size_t len);
+} level_t;
+
+/** \brief  Newline counting job for a chunk of data
+ */
+typedef struct chunk_job_s {
+    const unsigned char *data;      /**< start of chunk */
+    size_t               len;       /**< length of chunk */
+    uint64_t             lines;     /**< newlines in chunk */
+    pthread_t            thread;    /**< thread counting the chunk */
+    bool                 running;   /**< \c thread was started */
+} chunk_job_t;
+
+
+/** \brief  Get length of ASCII prefix, portable version
+ *
+ * Skips whole words of ASCII when possible.
+ *
+ * \param[in]   s   data
+ * \param[in]   len length of \a s
+ *
+ * \return  offset of the first non-ASCII byte, or \a len
+ */
+static size_t ascii_generic(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i + sizeof(uint64_t) <= len) {
+        uint64_t word;
+
+        memcpy(&word, s + i, sizeof word);
+        if (word & HIGH_BITS) {
+            break;
+        }
+        i += sizeof word;
+    }
+    while (i < len && s[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+/** \brief  Find substring in the tail of data, one position at a time
+ *
+ * \param[in]   s       data
+ * \param[in]   i       offset in \a s to start at
+ * \param[in]   len     length of \a s
+ * \param[in]   p       pattern
+ * \param[in]   plen    length of \a p
+ *
+ * \return  offset of the first occurrence of \a p at or after \a i, or \a len
+ */
+static size_t find_tail(const unsigned char *s, size_t i, size_t len,
+                        const unsigned char *p, size_t plen)
+{
+    for (; i + plen <= len; i++) {
+        if (s[i] == p[0] && memcmp(s + i, p, plen) == 0) {
+            return i;
+        }
+    }
+    return len;
+}
+
+/** \brief  Find substring, portable version
+ *
+ * Compares the first and last byte of \a p against eight positions of \a s at
+ * a time, only positions where both match are compared in full.
+ *
+ * \param[in]   s       data
+ * \param[in]   len     length of \a s
+ * \param[in]   p       pattern
+ * \param[in]   plen    length of \a p
+ *
+ * \return  offset of the first occurrence of \a p in \a s, or \a len
+ */
+static size_t find_generic(const unsigned char *s, size_t len,
+                           const unsigned char *p, size_t plen)
+{
+    uint64_t first = LOW_BITS * p[0];
+    uint64_t last  = LOW_BITS * p[plen - 1];
+    size_t   i     = 0;
+
+    while (i + plen - 1 + sizeof(uint64_t) <= len) {
+        uint64_t head;
+        uint64_t tail;
+
+        memcpy(&head, s + i, sizeof head);
+        memcpy(&tail, s + i + plen - 1, sizeof tail);
+        if (ZERO_BYTES(head ^ first) & ZERO_BYTES(tail ^ last)) {
+            for (size_t k = 0; k < sizeof(uint64_t); k++) {
+                if (s[i + k] == p[0] && memcmp(s + i + k, p, plen) == 0) {
+                    return i + k;
+                }
+            }
+        }
+        i += sizeof(uint64_t);
+    }
+    return find_tail(s, i, len, p, plen);
+}
+
+/** \brief  Count newlines, portable version
+ *
+ * Flags the newlines of eight bytes at a time without false positives and
+ * counts the flags.
+ *
+ * \param[in]   s   data
+ * \param[in]   len length of \a s
+ *
+ * \return  number of newlines in \a s
+ */
+static uint64_t lines_generic(const unsigned char *s, size_t len)
+{
+    uint64_t nl    = LOW_BITS * '\n';
+    uint64_t count = 0;
+    size_t   i     = 0;
+
+    while (i + sizeof(uint64_t) <= len) {
+        uint64_t word;
+
+        memcpy(&word, s + i, sizeof word);
+        word ^= nl;
+        /* high bit set in each byte that is zero: no borrows, so exact */
+        count += (uint64_t)__builtin_popcountll(~(((word & LOW7_BITS) + LOW7_BITS) | word)
+                                                & HIGH_BITS);
+        i += sizeof word;
+    }
+    for (; i < len; i++) {
+        count += s[i] == '\n';
+    }
+    return count;
+}
+
+
+#ifdef SCAN_X86
+
+/** \brief  Get length of ASCII prefix, SSE2 version
+ *
+ * \param[in]   s   data
+ * \param[in]   len length of \a s
+ *
+ * \return  offset of the first non-ASCII byte, or \a len
+ */
+__attribute__((target("sse2")))
+static size_t ascii_sse2(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i + 16u <= len) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(const void *)(s + i)));
+
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+        i += 16u;
+    }
+    return i + ascii_generic(s + i, len - i);
+}
+
+/** \brief  Find substring, SSE2 version
+ *
+ * Compares the first and last byte of \a p against 16 positions of \a s at a
+ * time, only positions where both match are compared in full.
+ *
+ * \param[in]   s       data
+ * \param[in]   len     length of \a s
+ * \param[in]   p       pattern
+ * \param[in]   plen    length of \a p
+ *
+ * \return  offset of the first occurrence of \a p in \a s, or \a len
+ */
+__attribute__((target("sse2")))
+static size_t find_sse2(const unsigned char *s, size_t len,
+                        const unsigned char *p, size_t plen)
+{
+    __m128i first = _mm_set1_epi8((char)p[0]);
+    __m128i last  = _mm_set1_epi8((char)p[plen - 1]);
+    size_t  i     = 0;
+
+    while (i + plen - 1 + 16u <= len) {
+        __m128i  head = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+        __m128i  tail = _mm_loadu_si128((const __m128i *)(const void *)(s + i + plen - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first),
+                                                                  _mm_cmpeq_epi8(tail, last)));
+
+        while (mask != 0) {
+            size_t k = (size_t)__builtin_ctz(mask);
+
+            if (memcmp(s + i + k, p, plen) == 0) {
+                return i + k;
+            }
+            mask &= mask - 1u;
+        }
+        i += 16u;
+    }
+    return find_tail(s, i, len, p, plen);
+}
+
+/** \brief  Count newlines, SSE2 version
+ *
+ * Compare results are accumulated in byte counters for up to 255 blocks of
+ * 16 bytes, then summed horizontally.
+ *
+ * \param[in]   s   data
+ * \param[in]   len length of \a s
+ *
+ * \return  number of newlines in \a s
+ */
+__attribute__((target("sse2")))
+static uint64_t lines_sse2(const unsigned char *s, size_t len)
+{
+    __m128i  nl   = _mm_set1_epi8('\n');
+    __m128i  zero = _mm_setzero_si128();
+    __m128i  sums = _mm_setzero_si128();
+    uint64_t part[2];
+    size_t   i    = 0;
+
+    while (i + 16u <= len) {
+        __m128i acc    = _mm_setzero_si128();
+        size_t  blocks = (len - i) / 16u;
+
+        if (blocks > 255u) {
+            blocks = 255u;
+        }
+        for (size_t b = 0; b < blocks; b++, i += 16u) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+
+            /* a match is -1, subtracting it counts up */
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(acc, zero));
+    }
+    _mm_storeu_si128((__m128i *)(void *)part, sums);
+    return part[0] + part[1] + lines_generic(s + i, len - i);
+}
+
+/** \brief  Get length of ASCII prefix, AVX2 version
+ *
+ * \param[in]   s   data
+ * \param[in]   len length of \a s
+ *
+ * \return  offset of the first non-ASCII byte, or \a len
+ */
+__attribute__((target("avx2")))
+static size_t ascii_avx2(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i + 32u <= len) {
+        int mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(const void *)(s + i)));
+
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+        i += 32u;
+    }
+    return i + ascii_sse2(s + i, len - i);
+}
+
+/** \brief  Find substring, AVX2 version
+ *
+ * Compares the first and last byte of \a p against 32 positions of \a s at a
+ * time, only positions where both match are compared in full.
+ *
+ * \param[in]   s       data
+ * \param[in]   len     length of \a s
+ * \param[in]   p       pattern
+ * \param[in]   plen    length of \a p
+ *
+ * \return  offset of the first occurrence of \a p in \a s, or \a len
+ */
+__attribute__((target("avx2")))
+static size_t find_avx2(const unsigned char *s, size_t len,
+                        const unsigned char *p, size_t plen)
+{
+    __m256i first = _mm256_set1_epi8((char)p[0]);
+    __m256i last  = _mm256_set1_epi8((char)p[plen - 1]);
+    size_t  i     = 0;
+
+    while (i + plen - 1 + 32u <= len) {
+        __m256i  head = _mm256_loadu_si256((const __m256i *)(const void *)(s + i));
+        __m256i  tail = _mm256_loadu_si256((const __m256i *)(const void *)(s + i + plen - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+                                                                        _mm256_cmpeq_epi8(tail, last)));
+
+        while (mask != 0) {
+            size_t k = (size_t)__builtin_ctz(mask);
+
+            if (memcmp(s + i + k, p, plen) == 0) {
+                return i + k;
+            }
+            mask &= mask - 1u;
+        }
+        i += 32u;
+    }
+    return find_sse2(s + i, len - i, p, plen) + i;
+}
+
+/** \brief  Count newlines, AVX2 version
+ *
+ * Compare results are accumulated in byte counters for up to 255 blocks of
+ * 32 bytes, then summed horizontally.
+ *
+ * \param[in]   s   data
+ * \param[in]   len length of \a s
+ *
+ * \return  number of newlines in \a s
+ */
+__attribute__((target("avx2")))
+static uint64_t lines_avx2(const unsigned char *s, size_t len)
+{
+    __m256i  nl   = _mm256_set1_epi8('\n');
+    __m256i  zero = _mm256_setzero_si256();
+    __m256i  sums = _mm256_setzero_si256();
+    uint64_t part[4];
+    size_t   i    = 0;
+
+    while (i + 32u <= len) {
+        __m256i acc    = _mm256_setzero_si256();
+        size_t  blocks = (len - i) / 32u;
+
+        if (blocks > 255u) {
+            blocks = 255u;
+        }
+        for (size_t b = 0; b < blocks; b++, i += 32u) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(s + i));
+
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(acc, zero));
+    }
+    _mm256_storeu_si256((__m256i *)(void *)part, sums);
+    return part[0] + part[1] + part[2] + part[3] + lines_sse2(s + i, len - i);
+}
+
+#endif  /* SCAN_X86 */
+
+
+/** \brief  CPU levels, from worst to best */
+static const level_t levels[] = {
+    { "generic", NULL,      ascii_generic,  find_generic,   lines_generic },
+#ifdef SCAN_X86
+    { "sse2",    "sse2",    ascii_sse2,     find_sse2,      lines_sse2 },
+    { "avx2",    "avx2",    ascii_avx2,     find_avx2,      lines_avx2 },
+#endif
+};
+
+/** \brief  Selected kernels */
+static const level_t *kernels = &levels[0];
+
+
+/** \brief  Count the newlines of a chunk
+ *
+ * \param[in,out]   arg     chunk job
+ *
+ * \return  \c NULL
+ */
+static void *chunk_run(void *arg)
+{
+    chunk_job_t *job = arg;
+
+    job->lines = kernels->lines(job->data, job->len);
+    return NULL;
+}
+
+
+/** \brief  Check if the CPU supports a level
+ *
+ * \param[in]   level   level
+ *
+ * \return  \c true if supported
+ */
+static bool level_supported(const level_t *level)
+{
+    if (level->feature == NULL) {
+        return true;
+    }
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(level->feature, "sse2") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+    if (strcmp(level->feature, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return false;
+}
+
+
+/** \brief  Select the scanning kernels
+ *
+ * Detects the features of the CPU and selects the best kernels it supports,
+ * or the kernels of level \a name.
+ *
+ * \param[in]   name    level name ("generic", "sse2", "avx2"), or \c NULL to
+ *                      select the best level
+ *
+ * \return  \c false if \a name is unknown or not supported by the CPU
+ */
+bool scan_init(const char *name)
+{
+    size_t count = sizeof levels / sizeof levels[0];
+
+    if (name == NULL) {
+        for (size_t i = count; i > 0; i--) {
+            if (level_supported(&levels[i - 1])) {
+                kernels = &levels[i - 1];
+                break;
+            }
+        }
+        return true;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(levels[i].name, name) == 0) {
+            if (!level_supported(&levels[i])) {
+                return false;
+            }
+            kernels = &levels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** \brief  Get name of the selected level
+ *
+ * \return  level name
+ */
+const char *scan_level(void)
+{
+    return kernels->name;
+}
+
+
+/** \brief  Validate UTF-8
+ *
+ * Check \a data for well-formed UTF-8 as defined by RFC 3629: no overlong
+ * encodings, no surrogates and no code points above U+10FFFF.
+ *
+ * Runs of ASCII are skipped by the selected kernel.
+ *
+ * \param[in]   data    data to validate
+ * \param[in]   len     length of \a data
+ *
+ * \return  offset of the first byte of the first invalid sequence, or \a len
+ *          if \a data is valid
+ */
+size_t scan_utf8(const char *data, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)data;
+    size_t               i = 0;
+
+    while (i < len) {
+        unsigned char c = s[i];
+        size_t        n;
+        unsigned char lo = 0x80;
+        unsigned char hi = 0xbf;
+
+        if (c < 0x80) {
+            /* ASCII: skip the whole run */
+            i += kernels->ascii(s + i, len - i);
+            continue;
+        }
+
+        /* determine sequence length and valid range of the second byte */
+        if (c >= 0xc2 && c <= 0xdf) {
+            n = 1;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+            if (c == 0xe0) {
+                lo = 0xa0;  /* overlong */
+            } else if (c == 0xed) {
+                hi = 0x9f;  /* surrogates */
+            }
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+            if (c == 0xf0) {
+                lo = 0x90;  /* overlong */
+            } else if (c == 0xf4) {
+                hi = 0x8f;  /* > U+10FFFF */
+            }
+        } else {
+            /* continuation byte, overlong lead byte or invalid */
+            return i;
+        }
+
+        if (i + n >= len || s[i + 1] < lo || s[i + 1] > hi) {
+            return i;
+        }
+        for (size_t k = 2; k <= n; k++) {
+            if ((s[i + k] & 0xc0) != 0x80) {
+                return i;
+            }
+        }
+        i += n + 1;
+    }
+    return len;
+}
+
+
+/** \brief  Find substring
+ *
+ * Uses the selected kernel.
+ *
+ * \param[in]   data    data to search
+ * \param[in]   len     length of \a data
+ * \param[in]   pattern pattern to find
+ * \param[in]   plen    length of \a pattern
+ *
+ * \return  offset of the first occurrence of \a pattern in \a data, or \a len
+ *          if not found
+ */
+size_t scan_find(const char *data, size_t len, const char *pattern, size_t plen)
+{
+    if (plen == 0) {
+        return 0;
+    }
+    if (plen > len) {
+        return len;
+    }
+    return kernels->find((const unsigned char *)data, len,
+                         (const unsigned char *)pattern, plen);
+}
+
+
+/** \brief  Count newlines
+ *
+ * Uses the selected kernel.
+ *
+ * \param[in]   data    data
+ * \param[in]   len     length of \a data
+ *
+ * \return  number of newlines in \a data
+ */
+uint64_t scan_lines(const char *data, size_t len)
+{
+    return kernels->lines((const unsigned char *)data, len);
+}
+
+
+/** \brief  Split data into chunks of whole lines and number them
+ *
+ * Splits \a data into \a nchunks chunks of about the same size, each starting
+ * at the start of a line, and counts the newlines of the chunks in parallel,
+ * one thread per chunk. The line number of the first line of each chunk then
+ * follows from the counts of the chunks before it, without a serial pass over
+ * the data. Chunks can be empty when lines are longer than a chunk.
+ *
+ * Only used by the benchmark, the evaluator numbers lines as it reads them.
+ *
+ * \param[in]   data    data
+ * \param[in]   len     length of \a data
+ * \param[in]   nchunks number of chunks, 0 to only count the newlines
+ * \param[out]  offsets offset in \a data of each chunk, \a nchunks entries
+ * \param[out]  lines   number of newlines before each chunk, which is the
+ *                      line number of its first line minus one, \a nchunks
+ *                      entries
+ *
+ * \return  number of newlines in \a data
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+uint64_t scan_chunks(const char *data, size_t len, unsigned int nchunks,
+                     size_t *offsets, uint64_t *lines)
+{
+    chunk_job_t *jobs;
+    uint64_t     total = 0;
+
+    if (nchunks == 0) {
+        return scan_lines(data, len);
+    }
+    jobs = malloc(nchunks * sizeof *jobs);
+    if (jobs == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, nchunks * sizeof *jobs);
+        exit(1);
+    }
+
+    /* move each boundary to the start of the next line */
+    for (unsigned int c = 0; c < nchunks; c++) {
+        size_t pos = (size_t)((uint64_t)len * c / nchunks);
+
+        if (c > 0 && pos < offsets[c - 1]) {
+            pos = offsets[c - 1];
+        }
+        if (pos > 0 && pos < len && data[pos - 1] != '\n') {
+            const char *nl = memchr(data + pos, '\n', len - pos);
+
+            pos = nl != NULL ? (size_t)(nl - data) + 1u : len;
+        }
+        offsets[c] = pos;
+    }
+    for (unsigned int c = 0; c < nchunks; c++) {
+        jobs[c].data    = (const unsigned char *)data + offsets[c];
+        jobs[c].len     = (c + 1 < nchunks ? offsets[c + 1] : len) - offsets[c];
+        jobs[c].running = false;
+    }
+
+    /* the calling thread counts the last chunk */
+    for (unsigned int c = 0; c + 1 < nchunks; c++) {
+        jobs[c].running = pthread_create(&jobs[c].thread, NULL, chunk_run, &jobs[c]) == 0;
+        if (!jobs[c].running) {
+            chunk_run(&jobs[c]);
+        }
+    }
+    chunk_run(&jobs[nchunks - 1]);
+
+    for (unsigned int c = 0; c < nchunks; c++) {
+        if (jobs[c].running) {
+            pthread_join(jobs[c].thread, NULL);
+        }
+        lines[c]  = total;
+        total    += jobs[c].lines;
+    }
+    free(jobs);
+    return total;
+}
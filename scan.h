@@ -0,0 +1,40 @@
+/** \file   scan.h
+ * \brief   Byte scanning kernels - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+bool        scan_init(const char *name);
+const char *scan_level(void);
+
+size_t      scan_utf8(const char *data, size_t len);
+size_t      scan_find(const char *data, size_t len, const char *pattern, size_t plen);
+uint64_t    scan_lines(const char *data, size_t len);
+uint64_t    scan_chunks(const char *data, size_t len, unsigned int nchunks,
+                        size_t *offsets, uint64_t *lines);
+
+#endif
@@ -0,0 +1,229 @@
+/** \file   symbols.c
+ * \brief   Symbol table
+ *
+ * Hash table of symbols defined on the command line, mapping names to values.
+ * Names and values are case-sensitive.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "symbols.h"
+
+
+/** \brief  Initial number of slots in the hash table, must be a power of 2 */
+#define SYMBOLS_INITIAL_SIZE    64
+
+/** \brief  Value of a symbol defined without value */
+#define SYMBOLS_DEFAULT_VALUE   "1"
+
+
+/** \brief  Symbol
+ */
+typedef struct symbol_s {
+    char     *name;         /**< name, \c NULL for an empty slot */
+    size_t    name_len;     /**< length of \c name */
+    char     *value;        /**< value */
+    size_t    value_len;    /**< length of \c value */
+    uint32_t  hash;         /**< hash of \c name */
+} symbol_t;
+
+
+/** \brief  Hash table, open addressing with linear probing */
+static symbol_t *table;
+
+/** \brief  Number of slots in \c table */
+static size_t table_size;
+
+/** \brief  Number of symbols in \c table */
+static size_t table_count;
+
+
+/** \brief  Allocate zeroed memory
+ *
+ * \param[in]   size    number of bytes
+ *
+ * \return  memory
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void *symbols_calloc(size_t size)
+{
+    void *ptr = calloc(1, size);
+
+    if (ptr == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, size);
+        exit(1);
+    }
+    return ptr;
+}
+
+/** \brief  Find slot for name
+ *
+ * \param[in]   name    name
+ * \param[in]   len     length of \a name
+ * \param[in]   hash    hash of \a name
+ *
+ * \return  slot containing \a name or the empty slot where it belongs
+ */
+static symbol_t *symbols_find(const char *name, size_t len, uint32_t hash)
+{
+    size_t mask = table_size - 1;
+
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        symbol_t *sym = &table[i];
+
+        if (sym->name == NULL
+                || (sym->hash == hash && sym->name_len == len
+                    && memcmp(sym->name, name, len) == 0)) {
+            return sym;
+        }
+    }
+}
+
+/** \brief  Double the size of the hash table
+ */
+static void symbols_grow(void)
+{
+    symbol_t *old      = table;
+    size_t    old_size = table_size;
+
+    table_size = table_size > 0 ? table_size * 2 : SYMBOLS_INITIAL_SIZE;
+    table      = symbols_calloc(table_size * sizeof *table);
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].name != NULL) {
+            *symbols_find(old[i].name, old[i].name_len, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+}
+
+
+/** \brief  Calculate hash of string
+ *
+ * 32-bit FNV-1a hash.
+ *
+ * \param[in]   s   string
+ * \param[in]   len length of \a s
+ *
+ * \return  hash
+ */
+uint32_t symbols_hash(const char *s, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/** \brief  Define symbol
+ *
+ * Define a symbol from a string of the form <tt>NAME=VALUE</tt>, or
+ * \c NAME to define it with the value "1". Defining a symbol again replaces
+ * its value.
+ *
+ * \param[in]   definition  symbol definition
+ *
+ * \return  \c false if the name is empty
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+bool symbols_define(const char *definition)
+{
+    const char *eq    = strchr(definition, '=');
+    const char *value = eq != NULL ? eq + 1 : SYMBOLS_DEFAULT_VALUE;
+    size_t      len   = eq != NULL ? (size_t)(eq - definition) : strlen(definition);
+    uint32_t    hash;
+    symbol_t   *sym;
+
+    if (len == 0) {
+        return false;
+    }
+
+    if ((table_count + 1) * 2 > table_size) {
+        symbols_grow();
+    }
+
+    hash = symbols_hash(definition, len);
+    sym  = symbols_find(definition, len, hash);
+    if (sym->name == NULL) {
+        sym->name = symbols_calloc(len + 1);
+        memcpy(sym->name, definition, len);
+        sym->name_len = len;
+        sym->hash     = hash;
+        table_count++;
+    } else {
+        free(sym->value);
+    }
+    sym->value_len = strlen(value);
+    sym->value     = symbols_calloc(sym->value_len + 1);
+    memcpy(sym->value, value, sym->value_len);
+    return true;
+}
+
+
+/** \brief  Look up value of symbol
+ *
+ * \param[in]   name        name
+ * \param[in]   len         length of \a name
+ * \param[out]  value_len   length of value
+ *
+ * \return  value or \c NULL when \a name isn't defined
+ */
+const char *symbols_lookup(const char *name, size_t len, size_t *value_len)
+{
+    const symbol_t *sym;
+
+    if (table_count == 0) {
+        return NULL;
+    }
+    sym = symbols_find(name, len, symbols_hash(name, len));
+    if (sym->name == NULL) {
+        return NULL;
+    }
+    *value_len = sym->value_len;
+    return sym->value;
+}
+
+
+/** \brief  Free the symbol table
+ */
+void symbols_free(void)
+{
+    for (size_t i = 0; i < table_size; i++) {
+        free(table[i].name);
+        free(table[i].value);
+    }
+    free(table);
+    table       = NULL;
+    table_size  = 0;
+    table_count = 0;
+}
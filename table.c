@@ -0,0 +1,486 @@
+/** \file   table.c
+ * \brief   Parallel table formatter
+ *
+ * Formats the table view of a file after it has been evaluated: while
+ * evaluating, each line is recorded as a row with its output and the change
+ * it makes to the stack. Afterwards the rows are split into disjoint chunks
+ * which are formatted in parallel into per-thread buffers, the buffers are
+ * then written in order.
+ *
+ * The output is byte-identical to the table printed by the test driver while
+ * evaluating, at the cost of keeping the text of the file in memory. All
+ * memory is kept when the table is reset, so formatting another file doesn't
+ * allocate memory once the buffers have grown large enough.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "table.h"
+
+
+/** \brief  Width of the source and output columns */
+#define COLUMN_WIDTH    40
+
+/** \brief  Minimum width of the line number column */
+#define LINENO_WIDTH    4
+
+
+/** \brief  Output column of a row
+ */
+enum {
+    OUTPUT_NONE,    /**< no output column (error before the output was set) */
+    OUTPUT_EMPTY,   /**< empty output column */
+    OUTPUT_SOURCE   /**< output column contains the source line */
+};
+
+/** \brief  Change made to the stack by a row
+ */
+enum {
+    OP_NONE,        /**< stack unchanged */
+    OP_IF_FALSE,    /**< IF with false condition pushed */
+    OP_IF_TRUE,     /**< IF with true condition pushed */
+    OP_ELSE,        /**< condition of top level inverted */
+    OP_ENDIF,       /**< top level pulled */
+    OP_SWITCH,      /**< SWITCH pushed */
+    OP_CASE_FALSE,  /**< condition of top level set to false */
+    OP_CASE_TRUE,   /**< condition of top level set to true */
+    OP_ENDSWITCH    /**< top level pulled */
+};
+
+/** \brief  Table row
+ */
+typedef struct row_s {
+    size_t        offset;   /**< offset of source line in \c text */
+    size_t        len;      /**< length of source line */
+    unsigned char output;   /**< output column (\c OUTPUT_*) */
+    unsigned char op;       /**< stack change (\c OP_*) */
+} row_t;
+
+/** \brief  Growable character buffer
+ */
+typedef struct buffer_s {
+    char   *data;   /**< data */
+    size_t  len;    /**< number of bytes used */
+    size_t  size;   /**< number of bytes allocated */
+} buffer_t;
+
+/** \brief  Formatting job for a chunk of rows
+ */
+typedef struct job_s {
+    size_t     first;   /**< index of first row */
+    size_t     last;    /**< index of row after the last row */
+    buffer_t   stack;   /**< stack as string of 0's and 1's */
+    buffer_t   out;     /**< formatted rows */
+    pthread_t  thread;  /**< thread formatting the chunk */
+    bool       running; /**< \c thread was started */
+} job_t;
+
+
+/** \brief  Rows of the table */
+static row_t *rows;
+
+/** \brief  Number of rows allocated in \c rows */
+static size_t rows_size;
+
+/** \brief  Number of rows in \c rows */
+static size_t rows_count;
+
+/** \brief  Text of the source lines */
+static buffer_t text;
+
+/** \brief  Stack used to determine the stack at the start of each chunk */
+static buffer_t replay;
+
+/** \brief  Formatting jobs */
+static job_t *jobs;
+
+/** \brief  Number of jobs allocated in \c jobs */
+static unsigned int jobs_size;
+
+
+/** \brief  Make room in buffer
+ *
+ * \param[in,out]   buffer  buffer
+ * \param[in]       need    number of bytes needed after \a buffer->len
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void buffer_reserve(buffer_t *buffer, size_t need)
+{
+    size_t  size;
+    char   *data;
+
+    if (buffer->data != NULL && buffer->size - buffer->len >= need) {
+        return;
+    }
+    size = buffer->size > 0 ? buffer->size * 2 : 65536;
+    while (size - buffer->len < need) {
+        size *= 2;
+    }
+    data = realloc(buffer->data, size);
+    if (data == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, size);
+        exit(1);
+    }
+    buffer->data = data;
+    buffer->size = size;
+}
+
+/** \brief  Apply stack change of a row to a stack string
+ *
+ * \param[in,out]   stack   stack as string of 0's and 1's
+ * \param[in]       op      stack change (\c OP_*)
+ */
+static void stack_apply(buffer_t *stack, unsigned char op)
+{
+    switch (op) {
+        case OP_IF_FALSE:
+        case OP_IF_TRUE:
+        case OP_SWITCH:
+            buffer_reserve(stack, 1);
+            stack->data[stack->len++] = op == OP_IF_TRUE ? '1' : '0';
+            break;
+        case OP_ELSE:
+            stack->data[stack->len - 1] ^= '0' ^ '1';
+            break;
+        case OP_CASE_FALSE:
+        case OP_CASE_TRUE:
+            stack->data[stack->len - 1] = op == OP_CASE_TRUE ? '1' : '0';
+            break;
+        case OP_ENDIF:
+        case OP_ENDSWITCH:
+            stack->len--;
+            break;
+        default:
+            break;
+    }
+}
+
+/** \brief  Format line number
+ *
+ * Equivalent to \c printf("%4" PRIu64, \a lineno).
+ *
+ * \param[out]  dst     destination
+ * \param[in]   lineno  line number
+ *
+ * \return  pointer to \a dst after the line number
+ */
+static char *format_lineno(char *dst, uint64_t lineno)
+{
+    char   digits[20];
+    size_t n = 0;
+
+    do {
+        digits[n++] = (char)('0' + lineno % 10);
+        lineno /= 10;
+    } while (lineno > 0);
+
+    for (size_t i = n; i < LINENO_WIDTH; i++) {
+        *dst++ = ' ';
+    }
+    while (n > 0) {
+        *dst++ = digits[--n];
+    }
+    return dst;
+}
+
+/** \brief  Format column
+ *
+ * Equivalent to \c printf("%-40s  ", \a s).
+ *
+ * \param[out]  dst destination
+ * \param[in]   s   column text
+ * \param[in]   len length of \a s
+ *
+ * \return  pointer to \a dst after the column
+ */
+static char *format_column(char *dst, const char *s, size_t len)
+{
+    memcpy(dst, s, len);
+    dst += len;
+    if (len < COLUMN_WIDTH) {
+        memset(dst, ' ', COLUMN_WIDTH - len);
+        dst += COLUMN_WIDTH - len;
+    }
+    *dst++ = ' ';
+    *dst++ = ' ';
+    return dst;
+}
+
+/** \brief  Format chunk of rows
+ *
+ * \param[in,out]   arg job (\c job_t *)
+ *
+ * \return  \c NULL
+ */
+static void *job_run(void *arg)
+{
+    job_t *job = arg;
+
+    job->out.len = 0;
+    for (size_t i = job->first; i < job->last; i++) {
+        const row_t *row    = &rows[i];
+        const char  *source = text.data + row->offset;
+        size_t       width  = row->len > COLUMN_WIDTH ? row->len : COLUMN_WIDTH;
+        char        *dst;
+
+        stack_apply(&job->stack, row->op);
+        buffer_reserve(&job->out, 20 + (width + 2) * 3 + job->stack.len + 3);
+        dst = job->out.data + job->out.len;
+
+        dst = format_lineno(dst, i + 1);
+        *dst++ = ' ';
+        *dst++ = ' ';
+        dst = format_column(dst, source, row->len);
+        if (row->output == OUTPUT_SOURCE) {
+            dst = format_column(dst, source, row->len);
+        } else if (row->output == OUTPUT_EMPTY) {
+            dst = format_column(dst, "", 0);
+        }
+        *dst++ = '[';
+        memcpy(dst, job->stack.data, job->stack.len);
+        dst += job->stack.len;
+        *dst++ = ']';
+        *dst++ = '\n';
+
+        job->out.len = (size_t)(dst - job->out.data);
+    }
+    return NULL;
+}
+
+
+/** \brief  Reset table for the next file
+ *
+ * Memory allocated for the table is kept.
+ */
+void table_reset(void)
+{
+    rows_count = 0;
+    text.len   = 0;
+}
+
+
+/** \brief  Free memory used by the table
+ */
+void table_free(void)
+{
+    for (unsigned int i = 0; i < jobs_size; i++) {
+        free(jobs[i].stack.data);
+        free(jobs[i].out.data);
+    }
+    free(jobs);
+    free(rows);
+    free(text.data);
+    free(replay.data);
+    jobs       = NULL;
+    jobs_size  = 0;
+    rows       = NULL;
+    rows_size  = 0;
+    rows_count = 0;
+    memset(&text, 0, sizeof text);
+    memset(&replay, 0, sizeof replay);
+}
+
+
+/** \brief  Add row to the table
+ *
+ * Like \c printf("%s"), the source line ends at the first nul character.
+ *
+ * \param[in]   source  source line
+ * \param[in]   len     length of \a source
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+void table_row(const char *source, size_t len)
+{
+    const char *nul = memchr(source, '\0', len);
+
+    if (nul != NULL) {
+        len = (size_t)(nul - source);
+    }
+
+    if (rows_count == rows_size) {
+        size_t  size = rows_size > 0 ? rows_size * 2 : 4096;
+        row_t  *tmp  = realloc(rows, size * sizeof *rows);
+
+        if (tmp == NULL) {
+            fprintf(stderr,
+                    "%s(): failed to allocate %zu bytes, exiting.\n",
+                    __func__, size * sizeof *rows);
+            exit(1);
+        }
+        rows      = tmp;
+        rows_size = size;
+    }
+
+    buffer_reserve(&text, len);
+    memcpy(text.data + text.len, source, len);
+
+    rows[rows_count].offset = text.len;
+    rows[rows_count].len    = len;
+    rows[rows_count].output = OUTPUT_NONE;
+    rows[rows_count].op     = OP_NONE;
+    rows_count++;
+    text.len += len;
+}
+
+
+/** \brief  Set output column of the last row
+ *
+ * \param[in]   live    output the source line
+ */
+void table_output(bool live)
+{
+    rows[rows_count - 1].output = live ? OUTPUT_SOURCE : OUTPUT_EMPTY;
+}
+
+
+/** \brief  Register IF on the last row
+ *
+ * \param[in]   state   condition of IF statement
+ */
+void table_if(bool state)
+{
+    rows[rows_count - 1].op = state ? OP_IF_TRUE : OP_IF_FALSE;
+}
+
+
+/** \brief  Register ELSE on the last row
+ */
+void table_else(void)
+{
+    rows[rows_count - 1].op = OP_ELSE;
+}
+
+
+/** \brief  Register ENDIF on the last row
+ */
+void table_endif(void)
+{
+    rows[rows_count - 1].op = OP_ENDIF;
+}
+
+
+/** \brief  Register SWITCH on the last row
+ */
+void table_switch(void)
+{
+    rows[rows_count - 1].op = OP_SWITCH;
+}
+
+
+/** \brief  Register CASE or DEFAULT on the last row
+ *
+ * \param[in]   state   condition of the SWITCH after the CASE or DEFAULT
+ */
+void table_case(bool state)
+{
+    rows[rows_count - 1].op = state ? OP_CASE_TRUE : OP_CASE_FALSE;
+}
+
+
+/** \brief  Register ENDSWITCH on the last row
+ */
+void table_endswitch(void)
+{
+    rows[rows_count - 1].op = OP_ENDSWITCH;
+}
+
+
+/** \brief  Format table and write it to stdout
+ *
+ * The rows are split into \a njobs chunks, each formatted in its own thread.
+ * The calling thread formats the last chunk, and any chunk for which a thread
+ * couldn't be created.
+ *
+ * \param[in]   njobs   number of chunks to format in parallel
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+void table_write(unsigned int njobs)
+{
+    size_t row;
+
+    if (njobs == 0) {
+        njobs = 1;
+    }
+    if (njobs > rows_count) {
+        njobs = (unsigned int)rows_count;
+    }
+    if (njobs == 0) {
+        return;
+    }
+
+    if (njobs > jobs_size) {
+        job_t *tmp = realloc(jobs, njobs * sizeof *jobs);
+
+        if (tmp == NULL) {
+            fprintf(stderr,
+                    "%s(): failed to allocate %zu bytes, exiting.\n",
+                    __func__, njobs * sizeof *jobs);
+            exit(1);
+        }
+        memset(tmp + jobs_size, 0, (njobs - jobs_size) * sizeof *jobs);
+        jobs      = tmp;
+        jobs_size = njobs;
+    }
+
+    /* replay the stack changes to get the stack at the start of each chunk */
+    replay.len = 0;
+    row        = 0;
+    for (unsigned int j = 0; j < njobs; j++) {
+        job_t *job = &jobs[j];
+
+        job->first = rows_count * j / njobs;
+        job->last  = rows_count * (j + 1) / njobs;
+        for (; row < job->first; row++) {
+            stack_apply(&replay, rows[row].op);
+        }
+        job->stack.len = 0;
+        buffer_reserve(&job->stack, replay.len);
+        memcpy(job->stack.data, replay.data, replay.len);
+        job->stack.len = replay.len;
+    }
+
+    for (unsigned int j = 0; j + 1 < njobs; j++) {
+        jobs[j].running = pthread_create(&jobs[j].thread, NULL, job_run, &jobs[j]) == 0;
+        if (!jobs[j].running) {
+            job_run(&jobs[j]);
+        }
+    }
+    job_run(&jobs[njobs - 1]);
+
+    for (unsigned int j = 0; j < njobs; j++) {
+        if (jobs[j].running) {
+            pthread_join(jobs[j].thread, NULL);
+            jobs[j].running = false;
+        }
+        fwrite(jobs[j].out.data, 1, jobs[j].out.len, stdout);
+    }
+}
@@ -0,0 +1,651 @@
+/** \file   tar.c
+ * \brief   Tar archive reading and writing
+ *
+ * Reads POSIX ustar archives sequentially from a file descriptor, so archives
+ * can be streamed from a pipe, and writes ustar archives to a stream.
+ *
+ * Besides plain ustar headers, GNU long names ('L') and the \c path record of
+ * pax extended headers ('x') are understood on input, members other than
+ * regular files are skipped. Names too long for a ustar header are written
+ * as GNU long names.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "tar.h"
+
+
+/** \brief  Offsets and sizes of ustar header fields
+ */
+enum {
+    HDR_NAME     = 0,   HDR_NAME_LEN     = 100,
+    HDR_MODE     = 100, HDR_MODE_LEN     = 8,
+    HDR_UID      = 108, HDR_UID_LEN      = 8,
+    HDR_GID      = 116, HDR_GID_LEN      = 8,
+    HDR_SIZE     = 124, HDR_SIZE_LEN     = 12,
+    HDR_MTIME    = 136, HDR_MTIME_LEN    = 12,
+    HDR_CHKSUM   = 148, HDR_CHKSUM_LEN   = 8,
+    HDR_TYPEFLAG = 156,
+    HDR_MAGIC    = 257, HDR_MAGIC_LEN    = 6,
+    HDR_VERSION  = 263, HDR_VERSION_LEN  = 2,
+    HDR_PREFIX   = 345, HDR_PREFIX_LEN   = 155
+};
+
+/** \brief  Size of the buffer for skipping data */
+#define TAR_SKIP_SIZE   65536
+
+/** \brief  Largest value of an 11-digit octal field */
+#define TAR_OCTAL_MAX   077777777777ULL
+
+
+/** \brief  Archive file descriptor */
+static int archive_fd = -1;
+
+/** \brief  Bytes to skip before the next header */
+static uint64_t skip;
+
+/** \brief  Name of the current member */
+static char *name;
+
+/** \brief  Size of \c name */
+static size_t name_size;
+
+/** \brief  Name from a GNU long name or pax header for the next member */
+static char *long_name;
+
+/** \brief  Size of \c long_name */
+static size_t long_name_size;
+
+/** \brief  \c long_name is set */
+static bool have_long_name;
+
+
+/** \brief  Ensure a name buffer can hold a string
+ *
+ * \param[in,out]   buf     name buffer
+ * \param[in,out]   size    size of \a buf
+ * \param[in]       len     length of string, excluding the terminating nul
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void name_reserve(char **buf, size_t *size, size_t len)
+{
+    char *tmp;
+
+    if (len < *size) {
+        return;
+    }
+    tmp = realloc(*buf, len + 1);
+    if (tmp == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, len + 1);
+        exit(1);
+    }
+    *buf  = tmp;
+    *size = len + 1;
+}
+
+/** \brief  Read exactly \a len bytes from the archive
+ *
+ * \param[out]  data    buffer
+ * \param[in]   len     number of bytes to read
+ *
+ * \return  \c TAR_MEMBER on success, \c TAR_ERR_IO or \c TAR_ERR_TRUNCATED
+ */
+static int read_full(void *data, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t count = read(archive_fd, (char *)data + done, len - done);
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return TAR_ERR_IO;
+        } else if (count == 0) {
+            return TAR_ERR_TRUNCATED;
+        }
+        done += (size_t)count;
+    }
+    return TAR_MEMBER;
+}
+
+/** \brief  Skip bytes of the archive
+ *
+ * Seeks when the archive is seekable, reads otherwise.
+ *
+ * \param[in]   len     number of bytes to skip
+ *
+ * \return  \c TAR_MEMBER on success, \c TAR_ERR_IO or \c TAR_ERR_TRUNCATED
+ */
+static int skip_data(uint64_t len)
+{
+    static char buffer[TAR_SKIP_SIZE];
+
+    if (len == 0) {
+        return TAR_MEMBER;
+    }
+    if (lseek(archive_fd, (off_t)len, SEEK_CUR) >= 0) {
+        return TAR_MEMBER;
+    }
+    while (len > 0) {
+        size_t chunk  = len < sizeof buffer ? (size_t)len : sizeof buffer;
+        int    result = read_full(buffer, chunk);
+
+        if (result != TAR_MEMBER) {
+            return result;
+        }
+        len -= chunk;
+    }
+    return TAR_MEMBER;
+}
+
+/** \brief  Get number of padding bytes after member data
+ *
+ * \param[in]   size    size of data
+ *
+ * \return  number of bytes to the next block boundary
+ */
+static uint64_t padding(uint64_t size)
+{
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+/** \brief  Parse numeric header field
+ *
+ * Fields are octal, optionally surrounded by spaces and nul bytes, or base-256
+ * when the high bit of the first byte is set (a GNU extension for large
+ * values).
+ *
+ * \param[in]   field   field
+ * \param[in]   len     length of \a field
+ * \param[out]  value   value
+ *
+ * \return  \c false if \a field is invalid
+ */
+static bool parse_number(const unsigned char *field, size_t len, uint64_t *value)
+{
+    size_t   i = 0;
+    uint64_t v = 0;
+
+    if (field[0] & 0x80) {
+        /* base-256, negative values aren't valid here */
+        if (field[0] & 0x40) {
+            return false;
+        }
+        v = field[0] & 0x3f;
+        for (i = 1; i < len; i++) {
+            if (v > (UINT64_MAX >> 8)) {
+                return false;
+            }
+            v = (v << 8) | field[i];
+        }
+        *value = v;
+        return true;
+    }
+
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        if (v > (UINT64_MAX >> 3)) {
+            return false;
+        }
+        v = (v << 3) | (uint64_t)(field[i] - '0');
+    }
+    for (; i < len; i++) {
+        if (field[i] != ' ' && field[i] != '\0') {
+            return false;
+        }
+    }
+    *value = v;
+    return true;
+}
+
+/** \brief  Verify header checksum
+ *
+ * \param[in]   header  header block
+ *
+ * \return  \c true if the checksum matches
+ */
+static bool checksum_valid(const unsigned char *header)
+{
+    uint64_t stored;
+    uint64_t sum = 0;
+
+    if (!parse_number(header + HDR_CHKSUM, HDR_CHKSUM_LEN, &stored)) {
+        return false;
+    }
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (i >= HDR_CHKSUM && i < HDR_CHKSUM + HDR_CHKSUM_LEN) {
+            sum += ' ';
+        } else {
+            sum += header[i];
+        }
+    }
+    return sum == stored;
+}
+
+/** \brief  Copy a header string field
+ *
+ * \param[out]  dest    destination
+ * \param[in]   field   field, nul-terminated unless it fills \a len bytes
+ * \param[in]   len     length of \a field
+ *
+ * \return  length of the copied string
+ */
+static size_t field_copy(char *dest, const unsigned char *field, size_t len)
+{
+    size_t n = strnlen((const char *)field, len);
+
+    memcpy(dest, field, n);
+    dest[n] = '\0';
+    return n;
+}
+
+/** \brief  Read data of a GNU long name member into \c long_name
+ *
+ * \param[in]   size    size of the data
+ *
+ * \return  \c TAR_MEMBER on success, or an error code
+ */
+static int read_long_name(uint64_t size)
+{
+    int result;
+
+    if (size > SIZE_MAX - 1) {
+        return TAR_ERR_FORMAT;
+    }
+    name_reserve(&long_name, &long_name_size, (size_t)size);
+    result = read_full(long_name, (size_t)size);
+    if (result != TAR_MEMBER) {
+        return result;
+    }
+    long_name[size] = '\0';
+    have_long_name  = true;
+    return skip_data(padding(size));
+}
+
+/** \brief  Read pax extended header and take its path record
+ *
+ * Records are "<length> <keyword>=<value>\n", other keywords are ignored.
+ *
+ * \param[in]   size    size of the header data
+ *
+ * \return  \c TAR_MEMBER on success, or an error code
+ */
+static int read_pax_header(uint64_t size)
+{
+    char   *data;
+    size_t  pos = 0;
+    int     result;
+
+    if (size > SIZE_MAX - 1) {
+        return TAR_ERR_FORMAT;
+    }
+    data = malloc((size_t)size + 1);
+    if (data == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, (size_t)size + 1);
+        exit(1);
+    }
+    result = read_full(data, (size_t)size);
+    if (result == TAR_MEMBER) {
+        data[size] = '\0';
+        while (pos < size) {
+            char          *end;
+            char          *record = data + pos;
+            unsigned long  len    = strtoul(record, &end, 10);
+
+            if (len == 0 || len > size - pos || *end != ' ' || record[len - 1] != '\n') {
+                result = TAR_ERR_FORMAT;
+                break;
+            }
+            if (end + 6 <= record + len - 1 && strncmp(end + 1, "path=", 5) == 0) {
+                size_t n = (size_t)(record + len - 1 - (end + 6));
+
+                name_reserve(&long_name, &long_name_size, n);
+                memcpy(long_name, end + 6, n);
+                long_name[n]   = '\0';
+                have_long_name = true;
+            }
+            pos += len;
+        }
+    }
+    free(data);
+    if (result != TAR_MEMBER) {
+        return result;
+    }
+    return skip_data(padding(size));
+}
+
+
+/** \brief  Start reading an archive
+ *
+ * \param[in]   fd  file descriptor of the archive, positioned at its start
+ */
+void tar_open(int fd)
+{
+    archive_fd     = fd;
+    skip           = 0;
+    have_long_name = false;
+}
+
+
+/** \brief  Get next regular file in the archive
+ *
+ * Skips the unread data of the previous member, see tar_consumed(). On
+ * success the archive is positioned at the member's data and
+ * \a member->name is valid until the next call.
+ *
+ * \param[out]  member  member
+ *
+ * \return  \c TAR_MEMBER, \c TAR_END at the end of the archive, or an error
+ *          code
+ */
+int tar_next(tar_member_t *member)
+{
+    unsigned char header[TAR_BLOCK_SIZE];
+
+    while (true) {
+        uint64_t size;
+        uint64_t mode;
+        uint64_t mtime;
+        size_t   len;
+        int      result = skip_data(skip);
+
+        skip = 0;
+        if (result != TAR_MEMBER) {
+            return result;
+        }
+        result = read_full(header, sizeof header);
+        if (result != TAR_MEMBER) {
+            return result;
+        }
+
+        /* a zero block marks the end of the archive */
+        len = 0;
+        while (len < sizeof header && header[len] == 0) {
+            len++;
+        }
+        if (len == sizeof header) {
+            return TAR_END;
+        }
+
+        if (!checksum_valid(header)
+                || !parse_number(header + HDR_SIZE, HDR_SIZE_LEN, &size)
+                || !parse_number(header + HDR_MODE, HDR_MODE_LEN, &mode)
+                || !parse_number(header + HDR_MTIME, HDR_MTIME_LEN, &mtime)) {
+            return TAR_ERR_FORMAT;
+        }
+
+        switch (header[HDR_TYPEFLAG]) {
+            case 'L':
+                result = read_long_name(size);
+                if (result != TAR_MEMBER) {
+                    return result;
+                }
+                continue;
+            case 'x':
+                result = read_pax_header(size);
+                if (result != TAR_MEMBER) {
+                    return result;
+                }
+                continue;
+            case '0':   /* fall through */
+            case '7':   /* fall through */
+            case '\0':
+                break;
+            default:
+                /* directory, link, device, global pax header, ... */
+                have_long_name = false;
+                skip = size + padding(size);
+                continue;
+        }
+
+        if (have_long_name) {
+            len = strlen(long_name);
+            name_reserve(&name, &name_size, len);
+            memcpy(name, long_name, len + 1);
+            have_long_name = false;
+        } else {
+            name_reserve(&name, &name_size, HDR_PREFIX_LEN + 1 + HDR_NAME_LEN);
+            len = 0;
+            if (memcmp(header + HDR_MAGIC, "ustar", 5) == 0 && header[HDR_PREFIX] != '\0') {
+                len = field_copy(name, header + HDR_PREFIX, HDR_PREFIX_LEN);
+                name[len++] = '/';
+            }
+            field_copy(name + len, header + HDR_NAME, HDR_NAME_LEN);
+        }
+
+        member->name  = name;
+        member->size  = size;
+        member->mode  = (unsigned int)(mode & 07777);
+        member->mtime = mtime;
+        skip = size + padding(size);
+        return TAR_MEMBER;
+    }
+}
+
+
+/** \brief  Report bytes of the current member's data read by the caller
+ *
+ * \param[in]   bytes   number of bytes read from the archive
+ */
+void tar_consumed(uint64_t bytes)
+{
+    skip -= bytes;
+}
+
+
+/** \brief  Free memory used for reading archives
+ */
+void tar_free(void)
+{
+    free(name);
+    free(long_name);
+    name           = NULL;
+    name_size      = 0;
+    long_name      = NULL;
+    long_name_size = 0;
+    have_long_name = false;
+    archive_fd     = -1;
+}
+
+
+/** \brief  Get error message
+ *
+ * \param[in]   result  result of tar_next()
+ *
+ * \return  error message
+ */
+const char *tar_strerror(int result)
+{
+    switch (result) {
+        case TAR_MEMBER:
+            return "OK";
+        case TAR_END:
+            return "end of archive";
+        case TAR_ERR_IO:
+            return strerror(errno);
+        case TAR_ERR_FORMAT:
+            return "invalid tar header";
+        case TAR_ERR_TRUNCATED:
+            return "unexpected end of archive";
+        default:
+            return "unknown error";
+    }
+}
+
+
+/** \brief  Store octal number in header field
+ *
+ * Values too large for \a len - 1 octal digits are stored in base-256.
+ *
+ * \param[out]  field   field
+ * \param[in]   len     length of \a field
+ * \param[in]   value   value
+ */
+static void put_number(unsigned char *field, size_t len, uint64_t value)
+{
+    if (len - 1 < 22 && value >> (3 * (len - 1)) != 0) {
+        for (size_t i = len; i > 1; i--) {
+            field[i - 1] = (unsigned char)(value & 0xff);
+            value >>= 8;
+        }
+        field[0] = 0x80;
+        return;
+    }
+    for (size_t i = len - 1; i > 0; i--) {
+        field[i - 1] = (unsigned char)('0' + (value & 7));
+        value >>= 3;
+    }
+    field[len - 1] = '\0';
+}
+
+/** \brief  Write header block
+ *
+ * \param[in]   fp          stream
+ * \param[in]   header      header with all fields but the checksum set
+ *
+ * \return  \c false on write error
+ */
+static bool write_header(FILE *fp, unsigned char *header)
+{
+    unsigned int sum = 0;
+
+    memset(header + HDR_CHKSUM, ' ', HDR_CHKSUM_LEN);
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += header[i];
+    }
+    snprintf((char *)header + HDR_CHKSUM, HDR_CHKSUM_LEN, "%06o", sum);
+    header[HDR_CHKSUM + 7] = ' ';
+    return fwrite(header, TAR_BLOCK_SIZE, 1, fp) == 1;
+}
+
+/** \brief  Write data padded to a block boundary
+ *
+ * \param[in]   fp      stream
+ * \param[in]   data    data
+ * \param[in]   len     length of \a data
+ *
+ * \return  \c false on write error
+ */
+static bool write_data(FILE *fp, const void *data, size_t len)
+{
+    static const char zeros[TAR_BLOCK_SIZE];
+    size_t            pad = (size_t)padding(len);
+
+    if (len > 0 && fwrite(data, 1, len, fp) != len) {
+        return false;
+    }
+    return pad == 0 || fwrite(zeros, 1, pad, fp) == pad;
+}
+
+/** \brief  Initialize header of a regular file
+ *
+ * \param[out]  header  header
+ * \param[in]   member  member
+ * \param[in]   size    size of the data
+ * \param[in]   type    type flag
+ */
+static void init_header(unsigned char *header, const tar_member_t *member,
+                        uint64_t size, char type)
+{
+    memset(header, 0, TAR_BLOCK_SIZE);
+    put_number(header + HDR_MODE, HDR_MODE_LEN, member->mode);
+    put_number(header + HDR_UID, HDR_UID_LEN, 0);
+    put_number(header + HDR_GID, HDR_GID_LEN, 0);
+    put_number(header + HDR_SIZE, HDR_SIZE_LEN, size);
+    put_number(header + HDR_MTIME, HDR_MTIME_LEN, member->mtime);
+    header[HDR_TYPEFLAG] = (unsigned char)type;
+    memcpy(header + HDR_MAGIC, "ustar", HDR_MAGIC_LEN);
+    memcpy(header + HDR_VERSION, "00", HDR_VERSION_LEN);
+}
+
+
+/** \brief  Write member to archive
+ *
+ * \param[in]   fp      stream
+ * \param[in]   member  member, the size is taken from \a len
+ * \param[in]   data    data
+ * \param[in]   len     length of \a data
+ *
+ * \return  \c false on write error
+ */
+bool tar_write(FILE *fp, const tar_member_t *member, const void *data, size_t len)
+{
+    unsigned char  header[TAR_BLOCK_SIZE];
+    const char    *path  = member->name;
+    size_t         plen  = strlen(path);
+    size_t         split = 0;
+
+    if (plen > HDR_NAME_LEN) {
+        /* split into prefix and name at a slash */
+        for (size_t i = plen - 2; i > 0 && i >= plen - HDR_NAME_LEN - 1; i--) {
+            if (path[i] == '/' && i <= HDR_PREFIX_LEN) {
+                split = i;
+            }
+        }
+        if (split == 0) {
+            /* GNU long name, the name itself is stored as the data */
+            init_header(header, member, plen + 1, 'L');
+            memcpy(header + HDR_NAME, "././@LongLink", sizeof "././@LongLink" - 1);
+            if (!write_header(fp, header) || !write_data(fp, path, plen + 1)) {
+                return false;
+            }
+        }
+    }
+
+    init_header(header, member, len, '0');
+    if (split > 0) {
+        memcpy(header + HDR_PREFIX, path, split);
+        memcpy(header + HDR_NAME, path + split + 1, plen - split - 1);
+    } else {
+        memcpy(header + HDR_NAME, path, plen < HDR_NAME_LEN ? plen : HDR_NAME_LEN);
+    }
+    return write_header(fp, header) && write_data(fp, data, len);
+}
+
+
+/** \brief  Write end of archive marker
+ *
+ * \param[in]   fp  stream
+ *
+ * \return  \c false on write error
+ */
+bool tar_finish(FILE *fp)
+{
+    static const char zeros[TAR_BLOCK_SIZE * 2];
+
+    return fwrite(zeros, sizeof zeros, 1, fp) == 1;
+}
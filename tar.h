@@ -0,0 +1,61 @@
+/** \file   tar.h
+ * \brief   Tar archive reading and writing - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TAR_H
+#define TAR_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** \brief  Size of a tar block */
+#define TAR_BLOCK_SIZE  512
+
+enum {
+    TAR_MEMBER,         /**< member found */
+    TAR_END,            /**< end of archive */
+    TAR_ERR_IO,         /**< I/O error, see \c errno */
+    TAR_ERR_FORMAT,     /**< invalid header */
+    TAR_ERR_TRUNCATED   /**< unexpected end of file */
+};
+
+/** \brief  Archive member
+ */
+typedef struct tar_member_s {
+    const char   *name;     /**< path of member */
+    uint64_t      size;     /**< size of member data */
+    unsigned int  mode;     /**< permission bits */
+    uint64_t      mtime;    /**< modification time */
+} tar_member_t;
+
+void        tar_open(int fd);
+int         tar_next(tar_member_t *member);
+void        tar_consumed(uint64_t bytes);
+void        tar_free(void);
+const char *tar_strerror(int result);
+
+bool        tar_write(FILE *fp, const tar_member_t *member, const void *data, size_t len);
+bool        tar_finish(FILE *fp);
+
+#endif
@@ -0,0 +1,590 @@
+/** \file   walk.c
+ * \brief   Parallel recursive directory traversal
+ *
+ * Finds the regular files below a directory using a pool of threads that each
+ * take a directory from a shared queue, read it and queue its subdirectories.
+ * The directories found form a tree that the consumer walks depth-first, so
+ * files are handed out in the same order whatever the number of threads, each
+ * as soon as its directory has been read. Processing can start before the
+ * traversal has finished.
+ *
+ * Files are selected with include and exclude globs (see \c fnmatch(3)). A
+ * glob containing a slash is matched against the path relative to the root
+ * directory, other globs against the name of the file or directory. Excluded
+ * directories aren't entered. Entries of a directory are handled in sorted
+ * order, the files of a directory before its subdirectories.
+ * Symbolic links to files are followed, links to directories aren't.
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "walk.h"
+
+
+/** \brief  Directory in the tree of directories found
+ *
+ * A directory is read by one of the threads, which sets its files and
+ * subdirectories and marks it read.
+ */
+typedef struct dir_s {
+    struct dir_s  *parent;      /**< parent directory, \c NULL for the root */
+    struct dir_s  *next;        /**< next subdirectory of the parent */
+    struct dir_s  *children;    /**< subdirectories not entered yet */
+    struct dir_s  *queued;      /**< next directory in the queue */
+    char          *path;        /**< path to directory */
+    char         **files;       /**< paths to the files, sorted */
+    size_t         files_count; /**< number of files in \c files */
+    size_t         files_pos;   /**< number of files handed out */
+    bool           read;        /**< directory has been read */
+} dir_t;
+
+/** \brief  Entry of a directory being read
+ */
+typedef struct entry_s {
+    char *name;     /**< name of entry */
+    bool  is_dir;   /**< entry is a directory */
+} entry_t;
+
+/** \brief  Glob list
+ */
+typedef struct globs_s {
+    const char **patterns;  /**< patterns */
+    size_t       count;     /**< number of patterns */
+} globs_t;
+
+
+/** \brief  Globs selecting files, empty to select all files */
+static globs_t includes;
+
+/** \brief  Globs excluding files and directories */
+static globs_t excludes;
+
+/** \brief  Lock protecting the tree, the queue and the counters */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** \brief  Signalled when a directory is queued or the traversal is done */
+static pthread_cond_t dirs_cond = PTHREAD_COND_INITIALIZER;
+
+/** \brief  Signalled when a directory has been read */
+static pthread_cond_t read_cond = PTHREAD_COND_INITIALIZER;
+
+/** \brief  Directories to read, those the consumer needs first at the front */
+static dir_t *queue;
+
+/** \brief  Directory whose files are handed out, \c NULL when all are */
+static dir_t *current;
+
+/** \brief  Number of directories queued or being read */
+static unsigned int pending;
+
+/** \brief  A directory couldn't be read */
+static bool failed;
+
+/** \brief  Length of the root directory path */
+static size_t root_len;
+
+/** \brief  Traversal threads */
+static pthread_t *threads;
+
+/** \brief  Number of threads in \c threads */
+static unsigned int threads_count;
+
+
+/** \brief  Allocate memory
+ *
+ * \param[in]   size    number of bytes
+ *
+ * \return  memory
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void *walk_malloc(size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (ptr == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, size);
+        exit(1);
+    }
+    return ptr;
+}
+
+/** \brief  Add pattern to glob list
+ *
+ * \param[in,out]   globs   glob list
+ * \param[in]       pattern pattern, must remain valid
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static void globs_add(globs_t *globs, const char *pattern)
+{
+    size_t       size = (globs->count + 1) * sizeof *globs->patterns;
+    const char **tmp  = realloc(globs->patterns, size);
+
+    if (tmp == NULL) {
+        fprintf(stderr,
+                "%s(): failed to allocate %zu bytes, exiting.\n",
+                __func__, size);
+        exit(1);
+    }
+    tmp[globs->count++] = pattern;
+    globs->patterns     = tmp;
+}
+
+/** \brief  Check if a glob list matches a path
+ *
+ * \param[in]   globs   glob list
+ * \param[in]   rel     path relative to the root directory
+ * \param[in]   name    name of the file or directory
+ *
+ * \return  \c true if any pattern matches
+ */
+static bool globs_match(const globs_t *globs, const char *rel, const char *name)
+{
+    for (size_t i = 0; i < globs->count; i++) {
+        const char *pattern = globs->patterns[i];
+
+        if (strchr(pattern, '/') != NULL) {
+            if (fnmatch(pattern, rel, FNM_PATHNAME) == 0) {
+                return true;
+            }
+        } else if (fnmatch(pattern, name, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** \brief  Join directory and name into a path
+ *
+ * \param[in]   dir     directory
+ * \param[in]   name    name in \a dir
+ *
+ * \return  path
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static char *path_join(const char *dir, const char *name)
+{
+    size_t  dir_len  = strlen(dir);
+    size_t  name_len = strlen(name);
+    size_t  pos      = dir_len;
+    char   *path     = walk_malloc(dir_len + 1 + name_len + 1);
+
+    memcpy(path, dir, dir_len);
+    if (pos > 0 && dir[pos - 1] != '/') {
+        path[pos++] = '/';
+    }
+    memcpy(path + pos, name, name_len + 1);
+    return path;
+}
+
+/** \brief  Create directory node
+ *
+ * \param[in]   parent  parent directory, \c NULL for the root
+ * \param[in]   path    path to directory, freed with the node
+ *
+ * \return  directory node
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+static dir_t *dir_new(dir_t *parent, char *path)
+{
+    dir_t *dir = walk_malloc(sizeof *dir);
+
+    dir->parent      = parent;
+    dir->next        = NULL;
+    dir->children    = NULL;
+    dir->queued      = NULL;
+    dir->path        = path;
+    dir->files       = NULL;
+    dir->files_count = 0;
+    dir->files_pos   = 0;
+    dir->read        = false;
+    return dir;
+}
+
+/** \brief  Free directory node and the paths of the files not handed out
+ *
+ * \param[in]   dir directory node
+ */
+static void dir_free(dir_t *dir)
+{
+    for (size_t i = dir->files_pos; i < dir->files_count; i++) {
+        free(dir->files[i]);
+    }
+    free(dir->files);
+    free(dir->path);
+    free(dir);
+}
+
+/** \brief  Compare directory entries by name for \c qsort()
+ *
+ * \param[in]   p1  first entry
+ * \param[in]   p2  second entry
+ *
+ * \return  <0, 0 or >0
+ */
+static int entry_compare(const void *p1, const void *p2)
+{
+    const entry_t *e1 = p1;
+    const entry_t *e2 = p2;
+
+    return strcmp(e1->name, e2->name);
+}
+
+/** \brief  Read directory and queue its subdirectories
+ *
+ * Called without the lock held. Sets the files and subdirectories of \a node
+ * and marks it read, also when the directory can't be read.
+ *
+ * \param[in,out]   node    directory node
+ */
+static void read_dir(dir_t *node)
+{
+    DIR            *dir;
+    struct dirent  *de;
+    entry_t        *entries  = NULL;
+    size_t          count    = 0;
+    size_t          size     = 0;
+    char          **files    = NULL;
+    size_t          nfiles   = 0;
+    dir_t          *subdirs  = NULL;
+    dir_t         **tail     = &subdirs;
+    unsigned int    nsubdirs = 0;
+
+    dir = opendir(node->path);
+    if (dir == NULL) {
+        fprintf(stderr, "error: failed to read directory \"%s\": (%d) %s\n",
+                node->path, errno, strerror(errno));
+        pthread_mutex_lock(&lock);
+        failed     = true;
+        node->read = true;
+        pthread_cond_signal(&read_cond);
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        bool        is_dir;
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        switch (de->d_type) {
+            case DT_REG:
+                is_dir = false;
+                break;
+            case DT_DIR:
+                is_dir = true;
+                break;
+            case DT_LNK:
+                /* follow links to files only */
+                if (fstatat(dirfd(dir), de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+                    continue;
+                }
+                is_dir = false;
+                break;
+            case DT_UNKNOWN:
+                if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                if (S_ISLNK(st.st_mode)
+                        && (fstatat(dirfd(dir), de->d_name, &st, 0) != 0
+                            || !S_ISREG(st.st_mode))) {
+                    continue;
+                }
+                if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+                    continue;
+                }
+                is_dir = S_ISDIR(st.st_mode);
+                break;
+            default:
+                continue;
+        }
+
+        if (count == size) {
+            entry_t *tmp;
+
+            size = size > 0 ? size * 2 : 64;
+            tmp  = realloc(entries, size * sizeof *entries);
+            if (tmp == NULL) {
+                fprintf(stderr,
+                        "%s(): failed to allocate %zu bytes, exiting.\n",
+                        __func__, size * sizeof *entries);
+                exit(1);
+            }
+            entries = tmp;
+        }
+        entries[count].name   = strdup(de->d_name);
+        entries[count].is_dir = is_dir;
+        if (entries[count].name == NULL) {
+            fprintf(stderr, "%s(): failed to allocate memory, exiting.\n", __func__);
+            exit(1);
+        }
+        count++;
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof *entries, entry_compare);
+    if (count > 0) {
+        files = walk_malloc(count * sizeof *files);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const entry_t *e    = &entries[i];
+        char          *path = path_join(node->path, e->name);
+        const char    *rel  = path + root_len;
+
+        while (*rel == '/') {
+            rel++;
+        }
+        if (globs_match(&excludes, rel, e->name)
+                || (!e->is_dir && includes.count > 0 && !globs_match(&includes, rel, e->name))) {
+            free(path);
+        } else if (e->is_dir) {
+            *tail = dir_new(node, path);
+            tail  = &(*tail)->next;
+            nsubdirs++;
+        } else {
+            files[nfiles++] = path;
+        }
+        free(e->name);
+    }
+    free(entries);
+
+    pthread_mutex_lock(&lock);
+    node->files       = files;
+    node->files_count = nfiles;
+    node->children    = subdirs;
+    node->read        = true;
+
+    /* the subdirectories are needed before the directories queued earlier */
+    for (dir_t *sub = subdirs; sub != NULL; sub = sub->next) {
+        sub->queued = sub->next != NULL ? sub->next : queue;
+    }
+    if (subdirs != NULL) {
+        queue = subdirs;
+    }
+    pending += nsubdirs;
+    if (nsubdirs > 0) {
+        pthread_cond_broadcast(&dirs_cond);
+    }
+    pthread_cond_signal(&read_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/** \brief  Traversal thread
+ *
+ * Reads directories until none are queued or being read.
+ *
+ * \param[in]   arg unused
+ *
+ * \return  \c NULL
+ */
+static void *walk_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    while (true) {
+        dir_t *node;
+
+        while (queue == NULL && pending > 0) {
+            pthread_cond_wait(&dirs_cond, &lock);
+        }
+        if (queue == NULL) {
+            break;
+        }
+        node  = queue;
+        queue = node->queued;
+        pthread_mutex_unlock(&lock);
+
+        read_dir(node);
+
+        pthread_mutex_lock(&lock);
+        if (--pending == 0) {
+            /* traversal done: wake idle threads */
+            pthread_cond_broadcast(&dirs_cond);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+
+/** \brief  Add include glob
+ *
+ * \param[in]   pattern glob, must remain valid
+ */
+void walk_include(const char *pattern)
+{
+    globs_add(&includes, pattern);
+}
+
+
+/** \brief  Add exclude glob
+ *
+ * \param[in]   pattern glob, must remain valid
+ */
+void walk_exclude(const char *pattern)
+{
+    globs_add(&excludes, pattern);
+}
+
+
+/** \brief  Free the glob lists
+ */
+void walk_free(void)
+{
+    free(includes.patterns);
+    free(excludes.patterns);
+    includes.patterns = NULL;
+    includes.count    = 0;
+    excludes.patterns = NULL;
+    excludes.count    = 0;
+}
+
+
+/** \brief  Start traversing a directory
+ *
+ * \param[in]   root        path to directory
+ * \param[in]   nthreads    number of threads reading directories
+ *
+ * \return  \c false if no thread could be started
+ *
+ * \note    Calls \c exit(1) on out-of-memory.
+ */
+bool walk_start(const char *root, unsigned int nthreads)
+{
+    char *path = strdup(root);
+
+    if (path == NULL) {
+        fprintf(stderr, "%s(): failed to allocate memory, exiting.\n", __func__);
+        exit(1);
+    }
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+    threads       = walk_malloc(nthreads * sizeof *threads);
+    threads_count = 0;
+    current       = dir_new(NULL, path);
+    queue         = current;
+    pending       = 1;
+    failed        = false;
+    root_len      = strlen(root);
+
+    for (unsigned int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[threads_count], NULL, walk_thread, NULL) == 0) {
+            threads_count++;
+        }
+    }
+    if (threads_count == 0) {
+        fprintf(stderr, "error: failed to start directory traversal: (%d) %s\n",
+                errno, strerror(errno));
+        dir_free(current);
+        current = NULL;
+        queue   = NULL;
+        free(threads);
+        threads = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+/** \brief  Get next file
+ *
+ * Files are returned depth-first in sorted order, the files of a directory
+ * before its subdirectories. Waits until the directory of the next file has
+ * been read.
+ *
+ * \return  path to file, to be freed by the caller, or \c NULL when all files
+ *          have been returned
+ */
+char *walk_next(void)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&lock);
+    while (current != NULL) {
+        dir_t *done;
+
+        while (!current->read) {
+            pthread_cond_wait(&read_cond, &lock);
+        }
+        if (current->files_pos < current->files_count) {
+            path = current->files[current->files_pos++];
+            break;
+        }
+        if (current->children != NULL) {
+            /* enter the first subdirectory */
+            done           = current;
+            current        = done->children;
+            done->children = current->next;
+            continue;
+        }
+        /* done with the directory and its subdirectories: go to the next
+         * subdirectory of the parent, which removed it from its children */
+        done    = current;
+        current = done->parent;
+        dir_free(done);
+    }
+    pthread_mutex_unlock(&lock);
+    return path;
+}
+
+
+/** \brief  Finish traversal
+ *
+ * Waits for the threads to finish and discards files not returned yet.
+ *
+ * \return  \c false if a directory couldn't be read
+ */
+bool walk_finish(void)
+{
+    char *path;
+
+    for (unsigned int i = 0; i < threads_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    threads       = NULL;
+    threads_count = 0;
+
+    while ((path = walk_next()) != NULL) {
+        free(path);
+    }
+    return !failed;
+}
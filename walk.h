@@ -0,0 +1,37 @@
+/** \file   walk.h
+ * \brief   Parallel recursive directory traversal - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/* Copyright (C) 2023  Bas Wassink
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdbool.h>
+
+void  walk_include(const char *pattern);
+void  walk_exclude(const char *pattern);
+void  walk_free(void);
+
+bool  walk_start(const char *root, unsigned int nthreads);
+char *walk_next(void);
+bool  walk_finish(void);
+
+#endif